@@ -32,11 +32,22 @@ CMD_START_TRANSFER = 0x01
 CMD_STOP_TRANSFER = 0x02
 CMD_GET_STATUS = 0x03
 CMD_SET_LAST_SENT = 0x04
+CMD_AGGREGATE = 0x05
+CMD_SET_TIME = 0x06
+CMD_L2CAP_TRANSFER = 0x07
+
+# Fields of CMD_AGGREGATE (storage_field_t) and the struct format of their values
+AGGREGATE_FIELDS = {'temp': (0, 'h'), 'press': (1, 'H'), 'hum': (2, 'H'), 'battery': (3, 'H')}
 
 # Packet types
 PACKET_TYPE_HEADER = 0
 PACKET_TYPE_DATA = 1
 PACKET_TYPE_END = 2
+PACKET_TYPE_AGGREGATE = 3
+PACKET_TYPE_MARKER = 4
+
+# Протокол v2: 32-битные номера записей (seq), не переполняются
+PROTOCOL_VERSION = 2
 
 # Database
 DB_PATH = "sensor_data.db"
@@ -246,28 +257,46 @@ def parse_uint16_be(data, offset):
         return None
     return (data[offset] << 8) | data[offset + 1]
 
+def parse_uint32_be(data, offset):
+    """Parse uint32 big-endian"""
+    if offset + 4 > len(data):
+        return None
+    return struct.unpack('>I', bytes(data[offset:offset+4]))[0]
+
 def encode_uint16_be(value):
     """Encode uint16 to big-endian bytes"""
     return bytes([(value >> 8) & 0xFF, value & 0xFF])
 
+def encode_uint32_be(value):
+    """Encode uint32 to big-endian bytes"""
+    return struct.pack('>I', value)
+
 def parse_status(data):
-    """Parse status characteristic data"""
+    """Parse status characteristic data (v1: 4 bytes, v2: 16 bytes)"""
     if len(data) < 4:
         return None
+    if len(data) >= 16:
+        return {
+            'total': parse_uint32_be(data, 4),
+            'last_sent': parse_uint32_be(data, 8),
+            'first_seq': parse_uint32_be(data, 12),
+            'backpressure': data[16] if len(data) >= 17 else 0,
+            'v2': True,
+        }
     return {
         'total': parse_uint16_be(data, 0),
         'last_sent': parse_uint16_be(data, 2),
+        'first_seq': 0,
+        'backpressure': 0,
+        'v2': False,
     }
 
 def parse_sensor_record(data, offset):
-    """Parse single sensor record (6 bytes)"""
+    """Parse single sensor record (6 bytes, little-endian as stored on the node)"""
     if offset + 6 > len(data):
         return None
     
-    temp_x10 = struct.unpack('>h', data[offset:offset+2])[0]
-    press_kpa = parse_uint16_be(data, offset+2)
-    hum_pct = data[offset+4]
-    bat_v_x10 = data[offset+5]
+    temp_x10, press_kpa, hum_pct, bat_v_x10 = struct.unpack('<hHBB', bytes(data[offset:offset+6]))
     
     return {
         'temp_c': temp_x10 / 10.0,
@@ -280,6 +309,88 @@ def parse_sensor_record(data, offset):
         'bat_raw': bat_v_x10
     }
 
+def parse_aggregate_packet(data):
+    """Parse AGGREGATE packet: field, from_seq, to_seq, count, min, max, mean"""
+    if len(data) < 20 or data[0] != PACKET_TYPE_AGGREGATE:
+        return None
+    field = data[1]
+    fmt = next((f for i, f in AGGREGATE_FIELDS.values() if i == field), 'H')
+    vmin, vmax, vmean = struct.unpack('>' + fmt * 3, bytes(data[14:20]))
+    return {
+        'field': field,
+        'from_seq': parse_uint32_be(data, 2),
+        'to_seq': parse_uint32_be(data, 6),
+        'count': parse_uint32_be(data, 10),
+        'min': vmin,
+        'max': vmax,
+        'mean': vmean,
+    }
+
+def parse_marker_packet(data):
+    """Parse MARKER packet: seq, boot, uptime_s, epoch_s, interval"""
+    if len(data) < 19 or data[0] != PACKET_TYPE_MARKER:
+        return None
+    return {
+        'seq': parse_uint32_be(data, 1),
+        'boot': parse_uint32_be(data, 5),
+        'uptime_s': parse_uint32_be(data, 9),
+        'epoch_s': parse_uint32_be(data, 13),
+        'interval': parse_uint16_be(data, 17),
+    }
+
+def split_l2cap_sdu(sdu):
+    """Split an L2CAP bulk transfer SDU into the v2 packets it holds"""
+    packets = []
+    offset = 0
+    while offset < len(sdu):
+        size = 20
+        if sdu[offset] == PACKET_TYPE_DATA and offset + 6 <= len(sdu):
+            size = max(6 + sdu[offset + 5] * 6, 20)
+        packets.append(sdu[offset:offset + size])
+        offset += size
+    return packets
+
+def marker_timestamp_ms(marker, seq):
+    """Wall-clock time of record seq from the marker before it, None if the
+    device did not know the time in that boot"""
+    if not marker or not marker['epoch_s']:
+        return None
+    return (marker['epoch_s'] + (seq - marker['seq']) * marker['interval']) * 1000
+
+async def query_aggregate(client, field, from_seq, to_seq, timeout=10.0):
+    """Ask the node for count/min/max/mean of a field over records [from_seq, to_seq).
+    Values are in record units (temp in 0.1 °C, battery in 0.1 V); hourly
+    statistics cost one packet per hour instead of a raw download."""
+    control_char = None
+    data_transfer_char = None
+    for service in client.services:
+        if DATA_SERVICE_UUID.lower() in service.uuid.lower():
+            for char in service.characteristics:
+                if CONTROL_UUID.lower() in char.uuid.lower():
+                    control_char = char
+                elif DATA_TRANSFER_UUID.lower() in char.uuid.lower():
+                    data_transfer_char = char
+    if not control_char or not data_transfer_char:
+        return None
+
+    result = asyncio.get_event_loop().create_future()
+
+    def handler(sender, data):
+        packet = parse_aggregate_packet(data)
+        if packet and not result.done():
+            result.set_result(packet)
+
+    await client.start_notify(data_transfer_char, handler)
+    try:
+        cmd = (bytes([CMD_AGGREGATE, AGGREGATE_FIELDS[field][0]]) +
+               encode_uint32_be(from_seq) + encode_uint32_be(to_seq))
+        await client.write_gatt_char(control_char, cmd, response=True)
+        return await asyncio.wait_for(result, timeout)
+    except asyncio.TimeoutError:
+        return None
+    finally:
+        await client.stop_notify(data_transfer_char)
+
 async def scan_and_connect():
     """Scan for device and return client"""
     print(f"⏱️  Старт: {datetime.now().isoformat(timespec='seconds')}")
@@ -383,10 +494,16 @@ async def download_data(client):
             return False
 
         device_total = initial_status['total']
+        use_v2 = initial_status['v2']
+        # v2 data packets fill the MTU: (MTU - 9) / 6 records each
+        print(f"   MTU: {client.mtu_size}")
         sync_state = db.get_sync_state(device_address)
         app_last_synced = max(sync_state['last_synced_seq'], -1)  # -1 означает нет данных
 
         start_index = app_last_synced + 1
+        if start_index < initial_status['first_seq']:
+            print(f"   ⚠ Записи {start_index}..{initial_status['first_seq'] - 1} уже перезаписаны на устройстве")
+            start_index = initial_status['first_seq']
         records_to_download = device_total - start_index
         if records_to_download <= 0:
             print("✅ Данные синхронизированы (новых нет)")
@@ -397,14 +514,18 @@ async def download_data(client):
         print(f"   Приложение: синхр. до {app_last_synced}")
         print(f"   Для скачивания: {records_to_download} записей (с {start_index})")
 
+        # Give the device the wall clock, so its time markers date the records
+        if use_v2:
+            time_cmd = bytes([CMD_SET_TIME]) + encode_uint32_be(int(datetime.now().timestamp()))
+            await client.write_gatt_char(control_char, time_cmd, response=True)
+
         # Setup notification handler
         transfer_complete = False
         last_packet_time = asyncio.get_event_loop().time()
+        marker = None
         
-        start_seq = start_index  # запоминаем начальный индекс для seq
-
         def notification_handler(sender, data):
-            nonlocal transfer_complete, last_packet_time
+            nonlocal transfer_complete, last_packet_time, marker
             if len(data) == 0:
                 return
             last_packet_time = asyncio.get_event_loop().time()
@@ -419,23 +540,39 @@ async def download_data(client):
                     transfer_stats['interval_sec'] = interval
                     print(f"  ✓ HEADER received: interval={interval}s")
             
+            elif packet_type == PACKET_TYPE_MARKER:
+                marker = parse_marker_packet(data)
+                if marker:
+                    print(f"  ✓ MARKER: seq={marker['seq']} boot={marker['boot']} epoch={marker['epoch_s']}")
+
             elif packet_type == PACKET_TYPE_DATA:
-                if len(data) >= 5:
-                    count = data[3]
+                if len(data) >= 6:
+                    if use_v2:
+                        packet_seq = parse_uint32_be(data, 1)
+                        count = data[5]
+                        offset = 6
+                    else:
+                        packet_seq = parse_uint16_be(data, 1)
+                        count = data[3]
+                        offset = 5
                     transfer_stats['data_packets'] += 1
                     transfer_stats['total_records'] += count
                     
                     # Parse records
-                    offset = 5
                     for i in range(count):
                         record = parse_sensor_record(data, offset)
                         if record:
                             # Добавляем seq и timestamp
-                            record['seq'] = start_seq + i
-                            # Генерируем timestamp на основе текущего времени и seq
-                            # В реальном приложении timestamp должен приходить от устройства
-                            current_time = int(datetime.now().timestamp() * 1000)
-                            record['timestamp_ms'] = current_time - (count - 1 - i) * 30000  # 30 сек интервал
+                            record['seq'] = packet_seq + i
+                            # Время записи по маркеру устройства; без него
+                            # (старая прошивка, часы не заданы) - оценка от текущего времени
+                            timestamp_ms = marker_timestamp_ms(marker, record['seq'])
+                            if timestamp_ms is None:
+                                current_time = int(datetime.now().timestamp() * 1000)
+                                timestamp_ms = current_time - (count - 1 - i) * 30000  # 30 сек интервал
+                            record['timestamp_ms'] = timestamp_ms
+                            if marker:
+                                record['boot'] = marker['boot']
                             received_records.append(record)
                             offset += 6
                         else:
@@ -445,8 +582,8 @@ async def download_data(client):
                         print(f"  Progress: {len(received_records)} records received...")
             
             elif packet_type == PACKET_TYPE_END:
-                if len(data) >= 2:
-                    total_sent = parse_uint16_be(data, 1)
+                if len(data) >= 3:
+                    total_sent = parse_uint32_be(data, 1) if use_v2 else parse_uint16_be(data, 1)
                     transfer_stats['end_received'] = True
                     transfer_complete = True
                     print(f"  ✓ END received: total_sent={total_sent}")
@@ -458,7 +595,10 @@ async def download_data(client):
         
         # Start transfer
         print(f"🚀 Скачивание {records_to_download} записей...")
-        start_cmd = bytes([CMD_START_TRANSFER]) + encode_uint16_be(start_index)
+        if use_v2:
+            start_cmd = bytes([CMD_START_TRANSFER]) + encode_uint32_be(start_index)
+        else:
+            start_cmd = bytes([CMD_START_TRANSFER]) + encode_uint16_be(start_index)
         await client.write_gatt_char(control_char, start_cmd, response=True)
         
         # Wait for transfer to complete (or idle timeout)
@@ -499,6 +639,8 @@ async def download_data(client):
             print(f"📊 Финальное состояние устройства:")
             print(f"   • Всего записей: {final_status['total']}")
             print(f"   • Последняя отправленная: {final_status['last_sent']}")
+            if final_status['backpressure']:
+                print(f"   ⚠ Память заполнена неподтверждёнными данными (backpressure {final_status['backpressure']})")
 
         # Сохраняем данные в базу
         if received_records:
@@ -509,6 +651,19 @@ async def download_data(client):
             new_last_synced = last_record['seq']
             db.update_sync_state(device_address, new_last_synced, len(received_records))
 
+            # Acknowledge the records received without gaps, so the device may
+            # reuse their flash pages
+            received_seqs = {r['seq'] for r in received_records}
+            ack_seq = start_index
+            while ack_seq in received_seqs:
+                ack_seq += 1
+            if ack_seq > start_index:
+                if use_v2:
+                    ack_cmd = bytes([CMD_SET_LAST_SENT]) + encode_uint32_be(ack_seq)
+                else:
+                    ack_cmd = bytes([CMD_SET_LAST_SENT]) + encode_uint16_be(ack_seq)
+                await client.write_gatt_char(control_char, ack_cmd, response=True)
+
             # Печать всех полученных записей
             print("\nПолученные записи (этот сеанс):")
             for i, r in enumerate(received_records, start=1):
@@ -1,9 +1,12 @@
 #include "ble_gatt.h"
 #include "config.h"
 #include "storage.h"  // ENABLED: storage for sensor data
+#include "rollup.h"
 #include <zephyr/kernel.h>
 #include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/l2cap.h>
 #include <zephyr/bluetooth/uuid.h>
 #include <zephyr/logging/log.h>
 #include <string.h>
@@ -24,10 +27,57 @@ static struct bt_uuid_128 status_uuid = BT_UUID_INIT_128(
 // Transfer state
 static bool transfer_in_progress = false;
 static uint32_t transfer_current_index = 0;
+static uint32_t transfer_skipped = 0;      // Records overwritten before they could be sent
 static uint32_t transfer_total_count = 0;
 static uint32_t transfer_start_seq = 0;  // Starting sequence number for current transfer
+static storage_cursor_t transfer_cursor;  // Log position of the next record to send
+static bool transfer_v2 = false;          // Peer asked for 32-bit sequence numbers
+static bool transfer_l2cap = false;       // Frames go out as SDUs on l2cap_chan
+static storage_marker_t transfer_marker;  // Last marker sent in this transfer
 static struct bt_conn *current_conn = NULL;
 
+// Notification pipeline: a credit per notification the stack may hold at
+// once, returned by its completion callback. The packet in packet_buffer
+// waits there (transfer_pending_len) until the stack accepts it.
+#define NOTIFY_IN_FLIGHT CONFIG_BT_BUF_ACL_TX_COUNT
+#define NOTIFY_RETRY_MS 10           // Retry delay when the stack has no buffer
+static K_SEM_DEFINE(notify_credits, NOTIFY_IN_FLIGHT, NOTIFY_IN_FLIGHT);
+
+typedef enum {
+    TRANSFER_HEADER,                 // Header packet next
+    TRANSFER_DATA,                   // Data packets
+    TRANSFER_MARKER,                 // Marker packet next, then data again
+    TRANSFER_DONE,                   // End packet built
+} transfer_state_t;
+
+static transfer_state_t transfer_state;
+static uint32_t transfer_held;           // Records read into packet_records, not yet sent
+static uint16_t transfer_pending_len;    // Packet built but not yet accepted by the stack
+static int64_t transfer_started_ms;      // Uptime at the header, for the throughput log
+
+// Transfers and aggregates run on their own work queue, so reading the log
+// and waiting for notification buffers never holds up the system work queue
+// (advertising restarts, Bluetooth host work). Only that queue touches the
+// transfer state above; START/STOP and disconnects post a request under
+// transfer_lock and reschedule the worker, which drops or starts transfers.
+static K_THREAD_STACK_DEFINE(transfer_q_stack, BLE_TRANSFER_THREAD_STACK_SIZE);
+static struct k_work_q transfer_q;
+static struct k_spinlock transfer_lock;
+static struct bt_conn *transfer_conn;          // Reference held by the running transfer
+static struct bt_conn *transfer_request_conn;  // Pending START request, NULL if none
+static uint32_t transfer_request_seq;
+static bool transfer_request_v2;
+static bool transfer_request_l2cap;
+
+static void transfer_worker(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(transfer_work, transfer_worker);
+
+// Pending CMD_AGGREGATE request
+static storage_field_t aggregate_field;
+static uint32_t aggregate_from_seq;
+static uint32_t aggregate_to_seq;
+static struct bt_conn *aggregate_conn;
+
 // Characteristic handles
 static struct bt_gatt_attr *data_transfer_attr = NULL;
 static struct bt_gatt_attr *control_attr = NULL;
@@ -53,8 +103,87 @@ static void restart_advertising(void)
 }
 
 
-// Packet buffer (20 bytes MTU)
-static uint8_t packet_buffer[20];
+// Packet buffer. Control packets and v1 data packets keep the 20-byte
+// layout of the default ATT MTU; v2 data packets fill the negotiated MTU.
+#define PACKET_SIZE 20
+#define DATA_HEADER_V2_SIZE 6
+#define DATA_RECORDS_MAX ((BLE_PACKET_MAX_SIZE - DATA_HEADER_V2_SIZE) / sizeof(sensor_record_t))
+static uint8_t packet_buffer[BLE_PACKET_MAX_SIZE];
+static sensor_record_t packet_records[DATA_RECORDS_MAX];  // Records gathered for one packet
+
+// Link profiles: a transfer asks for 2M PHY and a short interval without
+// latency, an idle link for a long interval with peripheral latency. The
+// central has the final say; le_param_updated()/le_phy_updated() log what
+// it picked, so transfer time and idle current can be compared per profile.
+typedef enum {
+    LINK_PROFILE_IDLE,
+    LINK_PROFILE_TRANSFER,
+} link_profile_t;
+
+// A transfer stopped by disconnected() still holds its reference to the
+// closed connection, which has no link parameters left to update
+static bool link_up(struct bt_conn *conn)
+{
+    struct bt_conn_info info;
+    return bt_conn_get_info(conn, &info) == 0 && info.state == BT_CONN_STATE_CONNECTED;
+}
+
+static void link_profile_set(struct bt_conn *conn, link_profile_t profile)
+{
+    bool transfer = (profile == LINK_PROFILE_TRANSFER);
+    const struct bt_le_conn_param *param = transfer ?
+        BT_LE_CONN_PARAM(BLE_TRANSFER_CONN_INTERVAL_MIN, BLE_TRANSFER_CONN_INTERVAL_MAX,
+                         0, BLE_TRANSFER_CONN_TIMEOUT) :
+        BT_LE_CONN_PARAM(BLE_IDLE_CONN_INTERVAL_MIN, BLE_IDLE_CONN_INTERVAL_MAX,
+                         BLE_IDLE_CONN_LATENCY, BLE_IDLE_CONN_TIMEOUT);
+    const struct bt_conn_le_phy_param *phy = transfer ? BT_CONN_LE_PHY_PARAM_2M :
+                                                        BT_CONN_LE_PHY_PARAM_1M;
+
+    LOG_INF("Requesting %s link profile", transfer ? "transfer" : "idle");
+    // -EALREADY: the link has these parameters already
+    int err = bt_conn_le_param_update(conn, param);
+    if (err && err != -EALREADY) {
+        LOG_WRN("Connection parameter update request failed: %d", err);
+    }
+    err = bt_conn_le_phy_update(conn, phy);
+    if (err && err != -EALREADY) {
+        LOG_WRN("PHY update request failed: %d", err);
+    }
+}
+
+// Start the pipeline of a new transfer on transfer_conn (transfer queue)
+static void transfer_begin(uint32_t start_seq, bool v2, bool l2cap)
+{
+    transfer_v2 = v2;
+    transfer_l2cap = l2cap;
+    // Records older than the ring tail are gone, start at the tail
+    transfer_start_seq = MAX(start_seq, storage_get_first_seq());
+    uint32_t next_seq = storage_get_next_seq();
+    if (next_seq > transfer_start_seq) {
+        transfer_total_count = next_seq - transfer_start_seq;
+    } else {
+        transfer_total_count = 0;  // No new data
+    }
+    LOG_INF("Starting %s data transfer (v%u) from seq %u, total records: %u",
+            l2cap ? "L2CAP" : "GATT", v2 ? 2 : 1, transfer_start_seq, transfer_total_count);
+    link_profile_set(transfer_conn, LINK_PROFILE_TRANSFER);
+    transfer_started_ms = k_uptime_get();
+
+    transfer_current_index = 0;
+    transfer_skipped = 0;
+    transfer_held = 0;
+    transfer_pending_len = 0;
+    transfer_state = TRANSFER_HEADER;
+    memset(&transfer_marker, 0, sizeof(transfer_marker));
+    storage_cursor_open(&transfer_cursor, transfer_start_seq);
+
+    // Completions of an earlier transfer may still be due; the credits
+    // start full either way
+    k_sem_reset(&notify_credits);
+    for (int i = 0; i < NOTIFY_IN_FLIGHT; i++) {
+        k_sem_give(&notify_credits);
+    }
+}
 
 static void encode_u16_be(uint8_t *dst, uint16_t v)
 {
@@ -70,151 +199,514 @@ static void encode_u32_be(uint8_t *dst, uint32_t v)
     dst[3] = (uint8_t)(v & 0xFF);
 }
 
-static int send_header_packet(void)
+static uint16_t clamp_u16(uint32_t v)
 {
-    if (!current_conn || !data_transfer_attr) {
-        return -ENOTCONN;
-    }
+    return (v > 65535) ? 65535 : (uint16_t)v;
+}
+
+// Storage holds off flash writes while a transfer is running
+static void set_transfer_in_progress(bool active)
+{
+    transfer_in_progress = active;
+    storage_set_transfer_active(active);
+}
 
+static uint16_t build_header_packet(void)
+{
+    memset(packet_buffer, 0, PACKET_SIZE);
     packet_buffer[0] = PACKET_TYPE_HEADER;
     
     // sensor_interval (2 bytes)
     encode_u16_be(&packet_buffer[1], SENSOR_READ_INTERVAL_SEC);
     
-    // total (2 bytes) - max 65535
-    uint32_t total = storage_get_count();
-    if (total > 65535) total = 65535;
-    encode_u16_be(&packet_buffer[3], (uint16_t)total);
-    
-    // last_sent (2 bytes)
-    uint32_t last_sent = storage_get_last_sent();
-    if (last_sent > 65535) last_sent = 65535;
-    encode_u16_be(&packet_buffer[5], (uint16_t)last_sent);
-    
-    // reserved (13 bytes) - zero
-    memset(&packet_buffer[7], 0, 13);
-
-    struct bt_gatt_notify_params params = {
-        .attr = data_transfer_attr,
-        .data = packet_buffer,
-        .len = sizeof(packet_buffer),
-    };
+    if (transfer_v2) {
+        // next_seq, last_sent, first_seq (4 bytes each) + version
+        encode_u32_be(&packet_buffer[3], storage_get_next_seq());
+        encode_u32_be(&packet_buffer[7], storage_get_last_sent());
+        encode_u32_be(&packet_buffer[11], storage_get_first_seq());
+        packet_buffer[15] = PROTOCOL_VERSION;
+    } else {
+        // total (2 bytes) - max 65535
+        encode_u16_be(&packet_buffer[3], clamp_u16(storage_get_next_seq()));
+        
+        // last_sent (2 bytes)
+        encode_u16_be(&packet_buffer[5], clamp_u16(storage_get_last_sent()));
+    }
 
-    return bt_gatt_notify_cb(current_conn, &params);
+    return PACKET_SIZE;
 }
 
-static int send_data_packet(uint32_t start_seq, uint8_t count, const sensor_record_t *records)
+// Records per data packet: 2 in the 20-byte layout, up to DATA_RECORDS_MAX
+// (39) in a v2 packet once the peer raised the ATT MTU, always
+// DATA_RECORDS_MAX in an L2CAP SDU
+static uint32_t data_packet_records(void)
 {
-    if (!current_conn || !data_transfer_attr) {
-        return -ENOTCONN;
+    if (transfer_l2cap) {
+        return DATA_RECORDS_MAX;
+    }
+
+    uint32_t size = PACKET_SIZE;
+    if (transfer_v2 && transfer_conn) {
+        // Notifications carry MTU - 3 bytes of value
+        size = CLAMP(bt_gatt_get_mtu(transfer_conn) - 3, PACKET_SIZE, BLE_PACKET_MAX_SIZE);
     }
+    return (size - (transfer_v2 ? DATA_HEADER_V2_SIZE : 5)) / sizeof(sensor_record_t);
+}
+
+// Data packet of the first count held records, which are the next ones of
+// the transfer; the rest stay held for the next packet
+static uint16_t build_data_packet(uint32_t count)
+{
+    uint32_t start_seq = transfer_start_seq + transfer_current_index;
 
+    memset(packet_buffer, 0, PACKET_SIZE);
     packet_buffer[0] = PACKET_TYPE_DATA;
     
-    // seq (2 bytes)
-    if (start_seq > 65535) start_seq = 65535;
-    encode_u16_be(&packet_buffer[1], (uint16_t)start_seq);
-    
-    // count (2 bytes)
-    packet_buffer[3] = count;
-    packet_buffer[4] = 0;
-    
-    // data (up to 15 bytes - 2 records max)
-    memcpy(&packet_buffer[5], records, count * sizeof(sensor_record_t));
+    uint8_t *data;
+    uint16_t len = PACKET_SIZE;
+    if (transfer_v2) {
+        // seq (4 bytes), count (1 byte)
+        encode_u32_be(&packet_buffer[1], start_seq);
+        packet_buffer[5] = (uint8_t)count;
+        data = &packet_buffer[DATA_HEADER_V2_SIZE];
+        len = MAX(DATA_HEADER_V2_SIZE + count * sizeof(sensor_record_t), PACKET_SIZE);
+    } else {
+        // seq (2 bytes)
+        encode_u16_be(&packet_buffer[1], clamp_u16(start_seq));
+        
+        // count (2 bytes)
+        packet_buffer[3] = (uint8_t)count;
+        packet_buffer[4] = 0;
+        data = &packet_buffer[5];
+    }
     
-    // padding
-    memset(&packet_buffer[5 + count * sizeof(sensor_record_t)], 0, 
-           15 - count * sizeof(sensor_record_t));
+    // Records; a short packet stays zero padded to 20 bytes
+    memcpy(data, packet_records, count * sizeof(sensor_record_t));
 
-    struct bt_gatt_notify_params params = {
-        .attr = data_transfer_attr,
-        .data = packet_buffer,
-        .len = sizeof(packet_buffer),
-    };
-
-    return bt_gatt_notify_cb(current_conn, &params);
+    transfer_current_index += count;
+    transfer_held -= count;
+    memmove(packet_records, &packet_records[count], transfer_held * sizeof(sensor_record_t));
+    return len;
 }
 
-static int send_end_packet(uint32_t total_sent)
+static uint16_t build_marker_packet(const storage_marker_t *marker)
 {
-    if (!current_conn || !data_transfer_attr) {
-        return -ENOTCONN;
+    // Wall-clock time the device knows now may date older records too
+    storage_time_t time;
+    if (storage_cursor_time(&transfer_cursor, marker->seq, &time) != 0) {
+        time.epoch_s = marker->epoch_s;
     }
 
+    memset(packet_buffer, 0, PACKET_SIZE);
+    packet_buffer[0] = PACKET_TYPE_MARKER;
+    encode_u32_be(&packet_buffer[1], marker->seq);
+    encode_u32_be(&packet_buffer[5], marker->boot_count);
+    encode_u32_be(&packet_buffer[9], marker->uptime_s);
+    encode_u32_be(&packet_buffer[13], time.epoch_s);
+    encode_u16_be(&packet_buffer[17], marker->interval_s);
+
+    return PACKET_SIZE;
+}
+
+static uint16_t build_end_packet(uint32_t total_sent)
+{
+    memset(packet_buffer, 0, PACKET_SIZE);
     packet_buffer[0] = PACKET_TYPE_END;
     
-    // total_sent (2 bytes)
-    if (total_sent > 65535) total_sent = 65535;
-    encode_u16_be(&packet_buffer[1], (uint16_t)total_sent);
-    
-    // reserved (17 bytes)
-    memset(&packet_buffer[3], 0, 17);
+    if (transfer_v2) {
+        // total_sent, resume_seq (4 bytes each)
+        encode_u32_be(&packet_buffer[1], total_sent);
+        encode_u32_be(&packet_buffer[5], transfer_cursor.next_seq);
+    } else {
+        // total_sent (2 bytes)
+        encode_u16_be(&packet_buffer[1], clamp_u16(total_sent));
+    }
+
+    return PACKET_SIZE;
+}
+
+static int send_aggregate_packet(struct bt_conn *conn, const rollup_stats_t *stats)
+{
+    if (!data_transfer_attr) {
+        return -ENOTCONN;
+    }
+
+    // Own buffer: packet_buffer may hold a transfer packet the stack has
+    // not accepted yet
+    uint8_t packet[PACKET_SIZE] = { 0 };
+    packet[0] = PACKET_TYPE_AGGREGATE;
+    packet[1] = (uint8_t)aggregate_field;
+    encode_u32_be(&packet[2], aggregate_from_seq);
+    encode_u32_be(&packet[6], aggregate_to_seq);
+    encode_u32_be(&packet[10], stats->count);
+    if (stats->count > 0) {
+        // 16-bit two's complement covers every field, signed or not
+        const sensor_record_t *values[] = { &stats->min, &stats->max, &stats->mean };
+        for (int i = 0; i < 3; i++) {
+            encode_u16_be(&packet[14 + 2 * i],
+                          (uint16_t)storage_record_field(values[i], aggregate_field));
+        }
+    }
 
     struct bt_gatt_notify_params params = {
         .attr = data_transfer_attr,
-        .data = packet_buffer,
-        .len = sizeof(packet_buffer),
+        .data = packet,
+        .len = PACKET_SIZE,
     };
 
-    return bt_gatt_notify_cb(current_conn, &params);
+    return bt_gatt_notify_cb(conn, &params);
 }
 
-static void transfer_worker(struct k_work *work)
+// Runs on the transfer work queue, so a long range never blocks the BLE stack
+static void aggregate_worker(struct k_work *work)
 {
-    if (!transfer_in_progress || !current_conn) {
-        return;
+    rollup_stats_t stats = { 0 };
+
+    int err = rollup_aggregate(aggregate_from_seq, aggregate_to_seq, &stats);
+    if (err && err != -ENODATA && err != -EINVAL) {
+        LOG_ERR("Aggregate over %u..%u failed: %d", aggregate_from_seq, aggregate_to_seq, err);
+        stats.count = 0;
     }
+    LOG_INF("Aggregate of field %u over %u..%u: %u records",
+            aggregate_field, aggregate_from_seq, aggregate_to_seq, stats.count);
+    send_aggregate_packet(aggregate_conn, &stats);
+    bt_conn_unref(aggregate_conn);
+    aggregate_conn = NULL;
+}
 
-    // Send header
-    if (transfer_current_index == 0) {
+// Build the next packet of the transfer in packet_buffer: the header, data
+// packets gathered from as many log spans as it takes, a marker whenever the
+// records that follow are timed by another one, then the end packet.
+// Returns its length, 0 if the end packet was built already.
+static uint16_t transfer_next_packet(void)
+{
+    if (transfer_state == TRANSFER_HEADER) {
         LOG_INF("Sending transfer header, total records: %u", transfer_total_count);
-        send_header_packet();
-        k_sleep(K_MSEC(50)); // Small delay between packets
+        transfer_state = TRANSFER_DATA;
+        return build_header_packet();
+    }
+    if (transfer_state == TRANSFER_MARKER) {
+        transfer_state = TRANSFER_DATA;
+        return build_marker_packet(&transfer_marker);
+    }
+    if (transfer_state == TRANSFER_DONE) {
+        return 0;
     }
 
-    // Send data packets
-    sensor_record_t records[2];
-    uint32_t records_sent = 0;
-    /* start from transfer_start_seq (provided by application) */
-    uint32_t start_seq = transfer_start_seq;
-    
-    while (transfer_current_index < transfer_total_count && records_sent < 100) {
-        // Read up to 2 records
-        uint8_t count = 0;
-        for (uint8_t i = 0; i < 2 && (transfer_current_index + i) < transfer_total_count; i++) {
-            if (storage_read(start_seq + transfer_current_index + i, &records[i]) == 0) {
-                count++;
-            } else {
-                /* If read fails, stop transfer and send END with what we have */
-                transfer_current_index = transfer_total_count;
-                break;
+    uint32_t per_packet = data_packet_records();
+    while (transfer_held < per_packet &&
+           transfer_current_index + transfer_held < transfer_total_count) {
+        const sensor_record_t *records;
+        uint32_t count = 0;
+        uint32_t remaining = transfer_total_count - transfer_current_index - transfer_held;
+        int err = storage_cursor_next_batch(&transfer_cursor, &records,
+                                            MIN(remaining, per_packet - transfer_held), &count);
+        if (err == -EOVERFLOW) {
+            /* The ring wrapped past the transfer: go on from the oldest record,
+             * data packets carry their seq so the gateway sees the gap. Held
+             * records come before the gap and go out first. */
+            uint16_t len = (transfer_held > 0) ? build_data_packet(transfer_held) : 0;
+            uint32_t skip_to = MIN(transfer_cursor.next_seq - transfer_start_seq,
+                                   transfer_total_count);
+            transfer_skipped += skip_to - transfer_current_index;
+            transfer_current_index = skip_to;
+            if (len > 0) {
+                return len;
             }
+            continue;
         }
-
-        if (count > 0) {
-            send_data_packet(start_seq + transfer_current_index, count, records);
-            transfer_current_index += count;
-            records_sent += count;
-            k_sleep(K_MSEC(50)); // Small delay between packets
-        } else {
+        if (err != 0 || count == 0) {
+            /* If read fails, stop transfer and send END with what we have */
+            transfer_total_count = transfer_current_index + transfer_held;
             break;
         }
+
+        uint32_t held = transfer_held;
+        memcpy(&packet_records[held], records, count * sizeof(sensor_record_t));
+        transfer_held += count;
+
+        // Tell the gateway how to time the records from here on; records
+        // held under the previous marker go out first
+        if (transfer_v2 && transfer_cursor.marker.interval_s != 0 &&
+            memcmp(&transfer_cursor.marker, &transfer_marker, sizeof(transfer_marker)) != 0) {
+            transfer_marker = transfer_cursor.marker;
+            if (held > 0) {
+                transfer_state = TRANSFER_MARKER;
+                return build_data_packet(held);
+            }
+            return build_marker_packet(&transfer_marker);
+        }
     }
 
-    // Send end packet if done
-    if (transfer_current_index >= transfer_total_count) {
-        LOG_INF("Transfer completed, sent %u records", records_sent);
-        send_end_packet(records_sent);
-        transfer_in_progress = false;
-        transfer_current_index = 0;
-    } else {
-        LOG_DBG("Transfer progress: %u/%u records", transfer_current_index, transfer_total_count);
-        // Schedule next batch
-        k_work_submit(work);
+    if (transfer_held > 0) {
+        return build_data_packet(transfer_held);
+    }
+
+    uint32_t total_sent = transfer_current_index - transfer_skipped;
+    uint32_t elapsed_ms = (uint32_t)(k_uptime_get() - transfer_started_ms);
+    LOG_INF("Transfer completed, sent %u records, %u lost to ring wrap, in %u ms (%u records/s)",
+            total_sent, transfer_skipped, elapsed_ms,
+            (uint32_t)((uint64_t)total_sent * MSEC_PER_SEC / MAX(elapsed_ms, 1U)));
+    transfer_state = TRANSFER_DONE;
+    return build_end_packet(total_sent);
+}
+
+// A notification left the controller: its buffer is free for the next one
+static void notify_sent(struct bt_conn *conn, void *user_data)
+{
+    k_sem_give(&notify_credits);
+    if (transfer_in_progress) {
+        k_work_reschedule_for_queue(&transfer_q, &transfer_work, K_NO_WAIT);
+    }
+}
+
+// Queue a transfer on conn; the worker drops whatever transfer is still
+// running and starts this one
+static int transfer_request(struct bt_conn *conn, uint32_t start_seq, bool v2, bool l2cap)
+{
+    k_spinlock_key_t key = k_spin_lock(&transfer_lock);
+    if (transfer_in_progress) {
+        k_spin_unlock(&transfer_lock, key);
+        return -EBUSY;
+    }
+    set_transfer_in_progress(true);
+    transfer_request_conn = bt_conn_ref(conn);
+    transfer_request_seq = start_seq;
+    transfer_request_v2 = v2;
+    transfer_request_l2cap = l2cap;
+    k_spin_unlock(&transfer_lock, key);
+
+    k_work_reschedule_for_queue(&transfer_q, &transfer_work, K_NO_WAIT);
+    return 0;
+}
+
+// Stop the transfer: the worker leaves its send loop at the next packet
+// and releases the connection
+static void transfer_stop(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&transfer_lock);
+    set_transfer_in_progress(false);
+    struct bt_conn *pending = transfer_request_conn;
+    transfer_request_conn = NULL;
+    k_spin_unlock(&transfer_lock, key);
+
+    if (pending) {
+        bt_conn_unref(pending);
+    }
+    k_work_reschedule_for_queue(&transfer_q, &transfer_work, K_NO_WAIT);
+}
+
+// The transfer ended by itself: END sent or the link failed. A request
+// posted meanwhile keeps the transfer flag for the next run.
+static void transfer_finish(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&transfer_lock);
+    if (!transfer_request_conn) {
+        set_transfer_in_progress(false);
+    }
+    k_spin_unlock(&transfer_lock, key);
+
+    if (link_up(transfer_conn)) {
+        link_profile_set(transfer_conn, LINK_PROFILE_IDLE);
+    }
+    bt_conn_unref(transfer_conn);
+    transfer_conn = NULL;
+    transfer_current_index = 0;
+}
+
+#if BLE_L2CAP_TRANSFER
+// L2CAP CoC bulk mode (CMD_L2CAP_TRANSFER): the frames of a v2 transfer are
+// packed back to back into SDUs of up to BLE_L2CAP_SDU_MAX bytes. The peer's
+// credits pace the channel; a new SDU is built whenever one of the
+// BLE_L2CAP_TX_SDUS buffers comes back.
+NET_BUF_POOL_FIXED_DEFINE(l2cap_tx_pool, BLE_L2CAP_TX_SDUS, BT_L2CAP_SDU_BUF_SIZE(BLE_L2CAP_SDU_MAX),
+                          CONFIG_BT_CONN_TX_USER_DATA_SIZE, NULL);
+
+static struct bt_l2cap_le_chan l2cap_chan;
+static bool l2cap_connected;
+
+static void l2cap_transfer_send(void)
+{
+    // The channel closed before the transfer got to run
+    if (!l2cap_connected && transfer_conn) {
+        LOG_WRN("L2CAP channel gone, transfer dropped");
+        transfer_finish();
+        return;
+    }
+
+    while (transfer_in_progress && !transfer_request_conn && l2cap_connected) {
+        struct net_buf *buf = net_buf_alloc(&l2cap_tx_pool, K_NO_WAIT);
+        if (!buf) {
+            return;  // l2cap_sent() runs the worker again
+        }
+        net_buf_reserve(buf, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+
+        // Whole frames only, each at most BLE_PACKET_MAX_SIZE bytes
+        size_t room = MIN(net_buf_tailroom(buf), l2cap_chan.tx.mtu);
+        while (transfer_state != TRANSFER_DONE && room - buf->len >= BLE_PACKET_MAX_SIZE) {
+            uint16_t len = transfer_next_packet();
+            net_buf_add_mem(buf, packet_buffer, len);
+        }
+
+        int err = bt_l2cap_chan_send(&l2cap_chan.chan, buf);
+        if (err < 0) {
+            net_buf_unref(buf);
+            if (transfer_in_progress) {
+                LOG_ERR("L2CAP SDU send failed: %d", err);
+            }
+            transfer_finish();
+            return;
+        }
+        if (transfer_state == TRANSFER_DONE) {
+            transfer_finish();
+            return;
+        }
+    }
+}
+
+static void l2cap_chan_connected(struct bt_l2cap_chan *chan)
+{
+    LOG_INF("L2CAP channel connected: tx SDU %u bytes, tx MPS %u, rx SDU %u bytes",
+            l2cap_chan.tx.mtu, l2cap_chan.tx.mps, l2cap_chan.rx.mtu);
+    if (l2cap_chan.tx.mtu < BLE_PACKET_MAX_SIZE) {
+        LOG_WRN("Peer SDU size below %u bytes, closing the channel", BLE_PACKET_MAX_SIZE);
+        bt_l2cap_chan_disconnect(chan);
+        return;
+    }
+    l2cap_connected = true;
+    if (transfer_in_progress) {
+        k_work_reschedule_for_queue(&transfer_q, &transfer_work, K_NO_WAIT);
+    }
+}
+
+static void l2cap_chan_disconnected(struct bt_l2cap_chan *chan)
+{
+    LOG_INF("L2CAP channel disconnected");
+    l2cap_connected = false;
+    if (transfer_l2cap && transfer_in_progress) {
+        transfer_stop();
+    }
+}
+
+// An SDU went out: its buffer is back in l2cap_tx_pool
+static void l2cap_chan_sent(struct bt_l2cap_chan *chan)
+{
+    if (transfer_in_progress) {
+        k_work_reschedule_for_queue(&transfer_q, &transfer_work, K_NO_WAIT);
+    }
+}
+
+// The channel carries no requests, incoming SDUs are dropped
+static int l2cap_chan_recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+    return 0;
+}
+
+static const struct bt_l2cap_chan_ops l2cap_chan_ops = {
+    .connected = l2cap_chan_connected,
+    .disconnected = l2cap_chan_disconnected,
+    .sent = l2cap_chan_sent,
+    .recv = l2cap_chan_recv,
+};
+
+static int l2cap_accept(struct bt_conn *conn, struct bt_l2cap_server *server,
+                        struct bt_l2cap_chan **chan)
+{
+    if (l2cap_chan.chan.conn) {
+        LOG_WRN("L2CAP channel already in use");
+        return -ENOMEM;
+    }
+    memset(&l2cap_chan, 0, sizeof(l2cap_chan));
+    l2cap_chan.chan.ops = &l2cap_chan_ops;
+    *chan = &l2cap_chan.chan;
+    return 0;
+}
+
+static struct bt_l2cap_server l2cap_server = {
+    .psm = BLE_L2CAP_PSM,
+    .sec_level = BT_SECURITY_L1,
+    .accept = l2cap_accept,
+};
+#endif // BLE_L2CAP_TRANSFER
+
+// Keeps up to NOTIFY_IN_FLIGHT notifications queued in the stack and returns
+// as soon as they are all in flight; notify_sent() runs it again for every
+// completed one, so the link runs at its own pace without sleeping on the
+// work queue.
+static void transfer_worker(struct k_work *work)
+{
+    k_spinlock_key_t key = k_spin_lock(&transfer_lock);
+    struct bt_conn *conn = transfer_request_conn;
+    uint32_t start_seq = transfer_request_seq;
+    bool v2 = transfer_request_v2;
+    bool l2cap = transfer_request_l2cap;
+    bool active = transfer_in_progress;
+    transfer_request_conn = NULL;
+    k_spin_unlock(&transfer_lock, key);
+
+    // Stopped, or replaced by a new request. A link still up after the stop
+    // (CMD_STOP_TRANSFER, closed L2CAP channel) goes back to the idle
+    // profile; after a disconnect only the reference is left to drop.
+    if ((conn || !active) && transfer_conn) {
+        if (!conn && link_up(transfer_conn)) {
+            link_profile_set(transfer_conn, LINK_PROFILE_IDLE);
+        }
+        bt_conn_unref(transfer_conn);
+        transfer_conn = NULL;
+    }
+    if (conn) {
+        transfer_conn = conn;
+        transfer_begin(start_seq, v2, l2cap);
     }
+
+#if BLE_L2CAP_TRANSFER
+    if (transfer_l2cap) {
+        l2cap_transfer_send();
+        return;
+    }
+#endif
+
+    // A pending request or stop ends the loop before the next packet
+    while (transfer_in_progress && !transfer_request_conn && transfer_conn &&
+           data_transfer_attr && k_sem_take(&notify_credits, K_NO_WAIT) == 0) {
+        if (transfer_pending_len == 0) {
+            transfer_pending_len = transfer_next_packet();
+        }
+
+        struct bt_gatt_notify_params params = {
+            .attr = data_transfer_attr,
+            .data = packet_buffer,
+            .len = transfer_pending_len,
+            .func = notify_sent,
+        };
+        int err = bt_gatt_notify_cb(transfer_conn, &params);
+        if (err == -ENOMEM || err == -ENOBUFS) {
+            // No buffer for it right now: send the same packet again shortly
+            k_sem_give(&notify_credits);
+            LOG_DBG("Notification deferred: %d", err);
+            k_work_reschedule_for_queue(&transfer_q, &transfer_work, K_MSEC(NOTIFY_RETRY_MS));
+            return;
+        }
+        if (err) {
+            k_sem_give(&notify_credits);
+            if (transfer_in_progress) {
+                LOG_ERR("Transfer notification failed: %d", err);
+            }
+            transfer_finish();
+            return;
+        }
+        transfer_pending_len = 0;
+
+        if (transfer_state == TRANSFER_DONE) {
+            transfer_finish();
+            return;
+        }
+    }
+
+    LOG_DBG("Transfer progress: %u/%u records", transfer_current_index, transfer_total_count);
 }
 
-static K_WORK_DEFINE(transfer_work, transfer_worker);
+static K_WORK_DEFINE(aggregate_work, aggregate_worker);
 static K_WORK_DEFINE(advertising_work, restart_advertising);
 
 // Data Transfer Characteristic (notify)
@@ -236,22 +728,11 @@ static ssize_t control_write(struct bt_conn *conn, const struct bt_gatt_attr *at
 
     switch (cmd) {
         case CMD_START_TRANSFER:
-            if (len >= 3) {  // CMD + 2 bytes start_index
-                uint16_t start_index = sys_get_be16(&data[1]);
-                if (!transfer_in_progress) {
-                    transfer_in_progress = true;
-                    transfer_current_index = 0;
-                    transfer_start_seq = start_index;  // Use provided start_index
-                    uint32_t total_count = storage_get_count();
-                    if (total_count > start_index) {
-                        transfer_total_count = total_count - start_index;
-                    } else {
-                        transfer_total_count = 0;  // No new data
-                    }
-                    current_conn = bt_conn_ref(conn);
-                    LOG_INF("Transfer command received, start_index: %u, total records: %u", start_index, transfer_total_count);
-                    k_work_submit(&transfer_work);
-                } else {
+            if (len >= 3) {  // CMD + 2 bytes start_index, or CMD + 4 bytes start_seq (v2)
+                bool v2 = (len >= 5);
+                uint32_t start_seq = v2 ? sys_get_be32(&data[1]) : sys_get_be16(&data[1]);
+                LOG_INF("Transfer command received (v%u), start_seq: %u", v2 ? 2 : 1, start_seq);
+                if (transfer_request(conn, start_seq, v2, false) == -EBUSY) {
                     LOG_WRN("Transfer already in progress");
                 }
             } else {
@@ -262,37 +743,86 @@ static ssize_t control_write(struct bt_conn *conn, const struct bt_gatt_attr *at
             
         case CMD_STOP_TRANSFER:
             LOG_INF("Stop transfer command received");
-            transfer_in_progress = false;
-            if (current_conn) {
-                bt_conn_unref(current_conn);
-                current_conn = NULL;
-            }
+            transfer_stop();
             break;
             
         case CMD_SET_LAST_SENT:
-            if (len >= 3) {
-                uint16_t last_sent = sys_get_be16(&data[1]);
-                storage_set_last_sent(last_sent);
+            if (len >= 5) {
+                storage_set_last_sent(sys_get_be32(&data[1]));
+            } else if (len >= 3) {
+                storage_set_last_sent(sys_get_be16(&data[1]));
             }
             break;
+
+        case CMD_AGGREGATE:
+            if (len < 10) {
+                LOG_WRN("Invalid AGGREGATE command length: %u", len);
+                return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+            }
+            if (data[1] > STORAGE_FIELD_BATTERY) {
+                return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+            }
+            if (k_work_busy_get(&aggregate_work) != 0) {
+                LOG_WRN("Aggregate already in progress");
+                return BT_GATT_ERR(BT_ATT_ERR_PROCEDURE_IN_PROGRESS);
+            }
+            aggregate_field = (storage_field_t)data[1];
+            aggregate_from_seq = sys_get_be32(&data[2]);
+            aggregate_to_seq = sys_get_be32(&data[6]);
+            aggregate_conn = bt_conn_ref(conn);
+            k_work_submit_to_queue(&transfer_q, &aggregate_work);
+            break;
+
+        case CMD_L2CAP_TRANSFER:
+#if BLE_L2CAP_TRANSFER
+            if (len < 5) {
+                LOG_WRN("Invalid L2CAP_TRANSFER command length: %u", len);
+                return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+            }
+            LOG_INF("L2CAP transfer command received, start_seq: %u, PSM 0x%04x",
+                    sys_get_be32(&data[1]), BLE_L2CAP_PSM);
+            // Nothing would ever end a transfer waiting for a channel
+            if (!l2cap_connected || l2cap_chan.chan.conn != conn) {
+                LOG_WRN("L2CAP transfer refused: no channel open on PSM 0x%04x",
+                        BLE_L2CAP_PSM);
+                return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+            }
+            if (transfer_request(conn, sys_get_be32(&data[1]), true, true) == -EBUSY) {
+                LOG_WRN("Transfer already in progress");
+            }
+            break;
+#else
+            return BT_GATT_ERR(BT_ATT_ERR_NOT_SUPPORTED);
+#endif
+
+        case CMD_SET_TIME:
+            if (len < 5) {
+                LOG_WRN("Invalid SET_TIME command length: %u", len);
+                return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+            }
+            storage_set_epoch(sys_get_be32(&data[1]));
+            break;
     }
 
     return len;
 }
 
 // Status characteristic read handler
+// Layout: count (u16), last_sent (u16) for legacy clients, then
+// next_seq, last_sent, first_seq as u32 (all big-endian), backpressure (u8)
 static ssize_t status_read(struct bt_conn *conn, const struct bt_gatt_attr *attr,
                            void *buf, uint16_t len, uint16_t offset)
 {
-    uint8_t status_data[4];
-    uint32_t count = storage_get_count();
+    uint8_t status_data[17];
+    uint32_t next_seq = storage_get_next_seq();
     uint32_t last_sent = storage_get_last_sent();
     
-    if (count > 65535) count = 65535;
-    if (last_sent > 65535) last_sent = 65535;
-    
-    encode_u16_be(&status_data[0], (uint16_t)count);
-    encode_u16_be(&status_data[2], (uint16_t)last_sent);
+    encode_u16_be(&status_data[0], clamp_u16(next_seq));
+    encode_u16_be(&status_data[2], clamp_u16(last_sent));
+    encode_u32_be(&status_data[4], next_seq);
+    encode_u32_be(&status_data[8], last_sent);
+    encode_u32_be(&status_data[12], storage_get_first_seq());
+    status_data[16] = (uint8_t)storage_get_backpressure();
 
     return bt_gatt_attr_read(conn, attr, buf, len, offset, status_data, sizeof(status_data));
 }
@@ -318,6 +848,51 @@ BT_GATT_SERVICE_DEFINE(data_service,
         status_read, NULL, NULL),
 );
 
+// The peer's reply to our MTU request; the new MTU is logged by
+// att_mtu_updated()
+static void mtu_exchanged(struct bt_conn *conn, uint8_t err,
+                          struct bt_gatt_exchange_params *params)
+{
+    if (err) {
+        LOG_WRN("MTU exchange failed: %u", err);
+    }
+}
+
+static struct bt_gatt_exchange_params mtu_exchange_params = {
+    .func = mtu_exchanged,
+};
+
+static void att_mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx)
+{
+    LOG_INF("ATT MTU updated: tx %u, rx %u (%u records per v2 data packet)", tx, rx,
+            (uint32_t)((MIN(tx - 3U, BLE_PACKET_MAX_SIZE) - DATA_HEADER_V2_SIZE) /
+                       sizeof(sensor_record_t)));
+}
+
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+    LOG_INF("Data length updated: tx %u bytes, rx %u bytes",
+            info->tx_max_len, info->rx_max_len);
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency,
+                             uint16_t timeout)
+{
+    // interval in 1.25 ms units, timeout in 10 ms units
+    LOG_INF("Connection parameters updated: interval %u us, latency %u, timeout %u ms",
+            interval * 1250U, latency, timeout * 10U);
+}
+
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+    LOG_INF("PHY updated: tx %u, rx %u (1 = 1M, 2 = 2M, 4 = Coded)",
+            param->tx_phy, param->rx_phy);
+}
+
+static struct bt_gatt_cb gatt_callbacks = {
+    .att_mtu_updated = att_mtu_updated,
+};
+
 // Connection callbacks
 // NOTE:
 // - bt_le_adv_stop() убрано из connected: рекламу не гасим при подключении, чтобы не ломать повторные подключения.
@@ -337,12 +912,24 @@ static void connected(struct bt_conn *conn, uint8_t err)
     status_attr = bt_gatt_find_by_uuid(NULL, 0, &status_uuid.uuid);
 
     LOG_INF("BLE client connected, attributes found");
+
+    // Largest link layer payload and ATT MTU the peer supports, so v2 data
+    // packets carry up to DATA_RECORDS_MAX records each. Peers that refuse
+    // keep the 23-byte MTU and 2 records per packet.
+    int ret = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+    if (ret) {
+        LOG_WRN("Data length update request failed: %d", ret);
+    }
+    ret = bt_gatt_exchange_mtu(conn, &mtu_exchange_params);
+    if (ret) {
+        LOG_WRN("MTU exchange request failed: %d", ret);
+    }
 }
 
 static void disconnected(struct bt_conn *conn, uint8_t reason)
 {
     LOG_INF("Disconnected callback called, reason=%u", reason);
-    transfer_in_progress = false;
+    transfer_stop();
     if (current_conn) {
         bt_conn_unref(current_conn);
         current_conn = NULL;
@@ -356,6 +943,9 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 static struct bt_conn_cb conn_callbacks = {
     .connected = connected,
     .disconnected = disconnected,
+    .le_param_updated = le_param_updated,
+    .le_data_len_updated = le_data_len_updated,
+    .le_phy_updated = le_phy_updated,
 };
 
 int ble_gatt_init(void)
@@ -368,8 +958,22 @@ int ble_gatt_init(void)
         LOG_ERR("Failed to register connection callbacks: %d", err);
         return err;
     }
+    bt_gatt_cb_register(&gatt_callbacks);
     LOG_INF("Connection callbacks registered");
 
+    k_work_queue_start(&transfer_q, transfer_q_stack, K_THREAD_STACK_SIZEOF(transfer_q_stack),
+                       BLE_TRANSFER_THREAD_PRIORITY,
+                       &(struct k_work_queue_config){ .name = "ble_transfer" });
+
+#if BLE_L2CAP_TRANSFER
+    err = bt_l2cap_server_register(&l2cap_server);
+    if (err) {
+        LOG_ERR("Failed to register L2CAP server: %d", err);
+        return err;
+    }
+    LOG_INF("L2CAP bulk transfer server on PSM 0x%04x", BLE_L2CAP_PSM);
+#endif
+
     // Attributes will be found when connection is established
     // using bt_gatt_find_by_uuid if needed
 
@@ -378,29 +982,21 @@ int ble_gatt_init(void)
 
 int ble_gatt_start_transfer(void)
 {
-    if (transfer_in_progress) {
-        LOG_WRN("Transfer already in progress");
-        return -EBUSY;
+    if (!current_conn) {
+        return -ENOTCONN;
     }
 
-    transfer_in_progress = true;
-    LOG_INF("Starting data transfer from index %u", transfer_start_seq);
-    transfer_current_index = 0;
     /* Send records starting from transfer_start_seq */
-    uint32_t total = storage_get_count();
-    if (total > transfer_start_seq) {
-        transfer_total_count = total - transfer_start_seq;
-    } else {
-        transfer_total_count = 0;
+    int err = transfer_request(current_conn, transfer_start_seq, transfer_v2, false);
+    if (err) {
+        LOG_WRN("Transfer already in progress");
     }
-    k_work_submit(&transfer_work);
-
-    return 0;
+    return err;
 }
 
 int ble_gatt_stop_transfer(void)
 {
-    transfer_in_progress = false;
+    transfer_stop();
     return 0;
 }
 
@@ -7,17 +7,69 @@
 
 // UUIDs are defined directly in ble_gatt.c
 
-// Packet types
+// Wire protocol version. v2 uses 32-bit sequence numbers; a client selects it
+// by sending 4-byte arguments with CMD_START_TRANSFER / CMD_SET_LAST_SENT.
+// v1 (2-byte arguments) clamps all counts and sequence numbers to 65535.
+#define PROTOCOL_VERSION 2
+
+// Packet types (20 bytes each, big-endian fields). DATA v2 packets grow with
+// the negotiated ATT MTU to MTU - 3 bytes (up to BLE_PACKET_MAX_SIZE, 39
+// records) and are never shorter than 20 bytes; count tells how many
+// records follow.
+//   HEADER v1: type, interval u16, total u16, last_sent u16
+//   HEADER v2: type, interval u16, next_seq u32, last_sent u32, first_seq u32, version u8
+//   DATA v1:   type, seq u16, count u8, 0, records
+//   DATA v2:   type, seq u32, count u8, records
+//   END v1:    type, total_sent u16
+//   END v2:    type, total_sent u32, resume_seq u32
+//   AGGREGATE: type, field u8, from_seq u32, to_seq u32, count u32, min u16, max u16, mean u16
+//   MARKER v2: type, seq u32, boot u32, uptime_s u32, epoch_s u32, interval u16
 #define PACKET_TYPE_HEADER 0
 #define PACKET_TYPE_DATA    1
 #define PACKET_TYPE_END     2
+#define PACKET_TYPE_AGGREGATE 3
+#define PACKET_TYPE_MARKER  4
+
+// v2 transfers send a MARKER packet (storage_marker_t) before the first DATA
+// packet and whenever the records that follow were timed by another marker:
+// record seq >= marker seq was taken at epoch_s + (seq - marker seq) *
+// interval seconds (epoch_s 0 = wall clock unknown for that boot; uptime_s
+// and boot still order the records).
 
 // Control commands
+// CMD_SET_LAST_SENT acknowledges every record below its sequence argument;
+// the status characteristic reports the resulting backpressure
+// (storage_backpressure_t) in its last byte.
 #define CMD_START_TRANSFER  0x01
 #define CMD_STOP_TRANSFER   0x02
 #define CMD_GET_STATUS      0x03
 #define CMD_SET_LAST_SENT   0x04
 
+// CMD_AGGREGATE: field u8 (storage_field_t), from_seq u32, to_seq u32
+// (exclusive). Answered with one AGGREGATE packet on the data transfer
+// characteristic holding the count and the minimum, maximum and mean of the
+// field over the records of the range (16-bit values in record units,
+// temperature signed). count 0 means no record of the range is stored.
+// Ranges aligned to blocks of 360 records (8640 for a day) are served from
+// the node's rollups (rollup.h) even after their raw records are gone; a
+// block is an hour of records only if none were missed or downsampled.
+// Refused with "procedure in progress" while the previous one is running.
+#define CMD_AGGREGATE       0x05
+
+// CMD_SET_TIME: epoch_s u32 (Unix seconds). Sets the wall clock the log's
+// time markers carry.
+#define CMD_SET_TIME        0x06
+
+// CMD_L2CAP_TRANSFER: start_seq u32. Starts a v2 transfer over an L2CAP
+// CoC channel on PSM BLE_L2CAP_PSM, which the gateway must open before the
+// command: without an open channel the write fails with "unlikely error".
+// Closing the channel stops the transfer. Every SDU holds whole v2 packets
+// back to back (HEADER, MARKER and END 20 bytes, DATA 6 + 6 * count bytes,
+// at least 20), up to BLE_L2CAP_SDU_MAX bytes; the last one ends with END.
+// Refused with "request not supported" when the node is built without
+// BLE_L2CAP_TRANSFER.
+#define CMD_L2CAP_TRANSFER  0x07
+
 // Initialize GATT server
 int ble_gatt_init(void);
 
@@ -2,14 +2,67 @@
 #define CONFIG_H
 
 #define SENSOR_READ_INTERVAL_SEC 10      // Sensor reading period (seconds)
-#define RAM_BUFFER_SIZE 200              // RAM buffer size before flash write
-#define FLASH_WRITE_INTERVAL_SEC 5       // Minimum interval between flash writes (seconds)
+#define RAM_BUFFER_SIZE 200              // Records staged in RAM before a flash write
+                                         // (the staging ring holds twice this)
+
+// Flush policy (flush_policy.c)
+#define FLUSH_MAX_AGE_SEC 1800           // Flush once the oldest staged record is this old (seconds)
+#define FLUSH_LOW_BATTERY_V_X10 33       // Below this battery voltage (0.1 V units)...
+#define FLUSH_LOW_BATTERY_RECORDS 20     // ...flush every this many records
+#define STORAGE_THREAD_STACK_SIZE 1536   // Storage thread (commits RAM buffers to flash)
+#define STORAGE_THREAD_PRIORITY 10       // Preemptible, below main and BLE
 #define ADV_CONNECTABLE_INTERVAL_MS 10000 // BLE advertising interval (ms)
                                           // Can be increased to 20000-30000 for maximum power savings
+#define BLE_PACKET_MAX_SIZE 244          // Largest v2 data notification (ATT MTU 247, 39 records)
+#define BLE_TRANSFER_THREAD_STACK_SIZE 2048 // Transfer work queue (log reads, notifications, aggregates)
+#define BLE_TRANSFER_THREAD_PRIORITY 11  // Preemptible, below the storage thread so flushes go first
+
+// Connection parameters requested for a transfer and after it (2M PHY during
+// transfers, 1M otherwise). Intervals in 1.25 ms units, timeouts in 10 ms
+#define BLE_TRANSFER_CONN_INTERVAL_MIN 6 // 7.5 ms
+#define BLE_TRANSFER_CONN_INTERVAL_MAX 12 // 15 ms
+#define BLE_TRANSFER_CONN_TIMEOUT 400    // 4 s, no peripheral latency
+#define BLE_IDLE_CONN_INTERVAL_MIN 400   // 500 ms
+#define BLE_IDLE_CONN_INTERVAL_MAX 800   // 1 s
+#define BLE_IDLE_CONN_LATENCY 4          // Connection events the node may skip
+#define BLE_IDLE_CONN_TIMEOUT 1200       // 12 s, above (1 + latency) * interval * 2
+
+// L2CAP CoC bulk transfers (CMD_L2CAP_TRANSFER); needs
+// CONFIG_BT_L2CAP_DYNAMIC_CHANNEL=y in prj.conf (RAM: SDUs * SDU bytes)
+#define BLE_L2CAP_TRANSFER 1             // 1 = register the channel server, 0 = GATT only
+#define BLE_L2CAP_PSM 0x0080             // LE dynamic PSM the gateway connects to
+#define BLE_L2CAP_SDU_MAX 4096           // Largest SDU sent (bytes)
+#define BLE_L2CAP_TX_SDUS 2              // SDUs queued on the channel at once
+
+// Flash storage: size and page layout come from the sensor_storage partition
+// at boot; these only bound the static buffers sized from them
+#define STORAGE_MAX_PAGE_SIZE 4096       // Largest flash page the log accepts (bytes)
+#define STORAGE_MAX_PAGES 256            // Pages beyond this are left unused
+
+// Record codec for new flash pages (existing pages stay readable either way)
+#define STORAGE_CODEC_DELTA 1            // 1 = keyframe + bit-packed deltas, 0 = raw 6-byte records
+#define STORAGE_CODEC_BENCHMARK 0        // 1 = log codec cost per record at boot
+
+// Decoder positions remembered for cursors opened inside a page, such as
+// storage_read() and storage_find() (RAM: about 60 bytes per slot)
+#define STORAGE_SEEK_CACHE_SLOTS 4       // Slots, one page each; 0 = always decode from the page start
+
+// Records the gateway has not acknowledged (CMD_SET_LAST_SENT) once they
+// fill the partition, see storage_retention_t
+#define STORAGE_RETENTION 0              // 0 = overwrite oldest, 1 = downsample then stop, 2 = stop
+#define STORAGE_DOWNSAMPLE_FILL_PCT 75   // Downsample once unacknowledged records fill this share of pages...
+#define STORAGE_DOWNSAMPLE_KEEP 4        // ...keeping one record in this many
+
+// 1 = log a benchmark of metadata checkpoints (ZMS vs NVS) at boot; needs
+// CONFIG_NVS=y next to CONFIG_ZMS=y and erases the stored metadata
+#define STORAGE_META_BENCH 0
+
+// Time markers in the log (storage_marker_t); a fresh one every this many
+// records bounds the drift of record times computed from the interval
+#define STORAGE_MARKER_RECORDS 360       // 1 hour at 10 s
 
-// Flash storage configuration for nRF54L15
-#define DATA_PARTITION_OFFSET 0x45000    // Offset from flash0 base (matches overlay)
-#define DATA_PARTITION_SIZE 0x7B000      // ~500 KB for data storage (nRF54L15 has 1.5 MB flash)
-#define FLASH_PAGE_SIZE 4096             // 4 KB page size for nRF54L15
+// Hourly/daily rollups (blocks of 360 records at 10 s) in the rollup_storage
+// partition, see rollup.h
+#define ROLLUP_DAILY_PAGES 2             // Partition pages for daily entries, the rest hold hourly ones
 
 #endif // CONFIG_H
@@ -0,0 +1,32 @@
+#include "flush_policy.h"
+#include "config.h"
+
+bool flush_policy_default(const storage_flush_state_t *state)
+{
+    if (state->staged == 0) {
+        return false;
+    }
+
+    // Last quarter of the ring is a reserve: flush no matter what, records
+    // would be dropped otherwise
+    if (state->staged >= state->capacity - state->capacity / 4) {
+        return true;
+    }
+
+    // Programming flash competes with the transfer for the log and the CPU
+    if (state->transfer_active) {
+        return false;
+    }
+
+    if (state->staged >= RAM_BUFFER_SIZE) {
+        return true;
+    }
+
+    // A brown-out loses everything still in RAM, keep that window short
+    if (state->battery_v_x10 != 0 && state->battery_v_x10 < FLUSH_LOW_BATTERY_V_X10 &&
+        state->staged >= FLUSH_LOW_BATTERY_RECORDS) {
+        return true;
+    }
+
+    return state->oldest_age_ms >= FLUSH_MAX_AGE_SEC * 1000U;
+}
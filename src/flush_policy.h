@@ -0,0 +1,12 @@
+#ifndef FLUSH_POLICY_H
+#define FLUSH_POLICY_H
+
+#include <stdbool.h>
+#include "storage.h"
+
+// Default flush policy: writes large batches (RAM_BUFFER_SIZE records) or
+// after FLUSH_MAX_AGE_SEC, sooner on a low battery, and holds off while a
+// BLE transfer is running unless the staging ring is nearly full
+bool flush_policy_default(const storage_flush_state_t *state);
+
+#endif // FLUSH_POLICY_H
@@ -0,0 +1,147 @@
+#include "meta_bench.h"
+#include "config.h"
+
+#if STORAGE_META_BENCH
+
+#if !defined(CONFIG_ZMS) || !defined(CONFIG_NVS)
+#error "STORAGE_META_BENCH needs CONFIG_ZMS=y and CONFIG_NVS=y"
+#endif
+
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/fs/zms.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(meta_bench, LOG_LEVEL_INF);
+
+// Few enough that neither scheme fills a sector: garbage collection would
+// mix erase time into the numbers
+#define BENCH_CHECKPOINTS 32
+#define BENCH_KEY_BASE 0x100
+
+typedef struct {
+    uint32_t avg_us;
+    uint32_t max_us;
+    uint32_t bytes;          // Bytes programmed per checkpoint
+} bench_result_t;
+
+// Bytes of the partition no longer in the erased state. Programmed bytes
+// that happen to be 0xFF are not seen, so this slightly undercounts.
+static uint32_t programmed_bytes(const struct flash_area *fa)
+{
+    uint8_t buf[64];
+    uint32_t count = 0;
+
+    for (uint32_t off = 0; off < fa->fa_size; off += sizeof(buf)) {
+        if (flash_area_read(fa, off, buf, sizeof(buf)) != 0) {
+            break;
+        }
+        for (size_t i = 0; i < sizeof(buf); i++) {
+            count += (buf[i] != 0xFF);
+        }
+    }
+    return count;
+}
+
+static void bench_time(bench_result_t *res, uint32_t cycles)
+{
+    uint32_t us = k_cyc_to_us_floor32(cycles);
+    res->avg_us += us;
+    res->max_us = MAX(res->max_us, us);
+}
+
+// Earlier scheme: write index, record count and last sent as separate keys
+static int bench_nvs(const struct flash_area *fa, uint32_t sector_size, bench_result_t *res)
+{
+    static struct nvs_fs fs;
+
+    fs.flash_device = flash_area_get_device(fa);
+    fs.offset = fa->fa_off;
+    fs.sector_size = sector_size;
+    fs.sector_count = 2;
+    int err = nvs_mount(&fs);
+    if (err) {
+        return err;
+    }
+
+    uint32_t base = programmed_bytes(fa);
+    for (uint32_t i = 0; i < BENCH_CHECKPOINTS; i++) {
+        uint32_t values[3] = { i * 3, i * 7, i * 5 };
+        uint32_t start = k_cycle_get_32();
+        for (int k = 0; k < 3; k++) {
+            ssize_t len = nvs_write(&fs, BENCH_KEY_BASE + k, &values[k], sizeof(values[k]));
+            if (len < 0) {
+                return (int)len;
+            }
+        }
+        bench_time(res, k_cycle_get_32() - start);
+    }
+    res->bytes = (programmed_bytes(fa) - base) / BENCH_CHECKPOINTS;
+    return 0;
+}
+
+// Current scheme: one packed entry of at most 8 bytes
+static int bench_zms(const struct flash_area *fa, uint32_t sector_size, bench_result_t *res)
+{
+    static struct zms_fs fs;
+
+    fs.flash_device = flash_area_get_device(fa);
+    fs.offset = fa->fa_off;
+    fs.sector_size = sector_size;
+    fs.sector_count = 2;
+    int err = zms_mount(&fs);
+    if (err) {
+        return err;
+    }
+
+    uint32_t base = programmed_bytes(fa);
+    for (uint32_t i = 0; i < BENCH_CHECKPOINTS; i++) {
+        uint32_t state[2] = { i * 5, 1 };
+        uint32_t start = k_cycle_get_32();
+        ssize_t len = zms_write(&fs, BENCH_KEY_BASE, state, sizeof(state));
+        if (len < 0) {
+            return (int)len;
+        }
+        bench_time(res, k_cycle_get_32() - start);
+    }
+    res->bytes = (programmed_bytes(fa) - base) / BENCH_CHECKPOINTS;
+    return 0;
+}
+
+void meta_bench_run(uint8_t partition_id)
+{
+    const struct flash_area *fa;
+    struct flash_pages_info info;
+
+    if (flash_area_open(partition_id, &fa) != 0 ||
+        flash_get_page_info_by_offs(flash_area_get_device(fa), fa->fa_off, &info) != 0) {
+        LOG_ERR("Benchmark: metadata partition not available");
+        return;
+    }
+
+    static const char *const names[] = { "NVS, 3 keys", "ZMS, 1 packed entry" };
+    for (int scheme = 0; scheme < 2; scheme++) {
+        bench_result_t res = { 0 };
+        int err = flash_area_erase(fa, 0, fa->fa_size);
+        if (!err) {
+            err = (scheme == 0) ? bench_nvs(fa, info.size, &res) :
+                                  bench_zms(fa, info.size, &res);
+        }
+        if (err) {
+            LOG_ERR("Benchmark %s failed: %d", names[scheme], err);
+            continue;
+        }
+        LOG_INF("Benchmark %s: %u checkpoints, %u us avg, %u us max, %u bytes each",
+                names[scheme], BENCH_CHECKPOINTS, res.avg_us / BENCH_CHECKPOINTS,
+                res.max_us, res.bytes);
+    }
+
+    // Leave an empty partition for the real metadata store
+    (void)flash_area_erase(fa, 0, fa->fa_size);
+    flash_area_close(fa);
+}
+
+#endif // STORAGE_META_BENCH
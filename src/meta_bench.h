@@ -0,0 +1,13 @@
+#ifndef META_BENCH_H
+#define META_BENCH_H
+
+#include <stdint.h>
+
+// Development benchmark of metadata checkpoints, built with
+// STORAGE_META_BENCH (config.h). Writes the same number of checkpoints as a
+// single packed ZMS entry and as the earlier three separate NVS keys, and
+// logs write latency and bytes programmed per checkpoint for each. Erases
+// the partition: the stored metadata is lost.
+void meta_bench_run(uint8_t partition_id);
+
+#endif // META_BENCH_H
@@ -0,0 +1,272 @@
+#include "record_codec.h"
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <errno.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(record_codec, LOG_LEVEL_INF);
+
+// Each field is coded as the zigzag of its delta to the previous record:
+//   0                 -> '0'
+//   1..4              -> '10'  + 2 bits
+//   5..36             -> '110' + 5 bits
+//   anything else     -> '111' + raw field value
+// A keyframe stores the four raw fields without prefixes (48 bits).
+#define SMALL_BITS 2
+#define SMALL_MAX  (1U << SMALL_BITS)
+#define MEDIUM_BITS 5
+#define MEDIUM_MAX (SMALL_MAX + (1U << MEDIUM_BITS))
+
+#define FIELD_COUNT 4
+
+static const uint8_t field_width[FIELD_COUNT] = { 16, 16, 8, 8 };
+
+static void get_fields(const sensor_record_t *record, uint32_t fields[FIELD_COUNT])
+{
+    fields[0] = (uint16_t)record->temp_x10;
+    fields[1] = record->press_kpa;
+    fields[2] = record->hum_pct;
+    fields[3] = record->battery_v_x10;
+}
+
+static void set_fields(sensor_record_t *record, const uint32_t fields[FIELD_COUNT])
+{
+    record->temp_x10 = (int16_t)fields[0];
+    record->press_kpa = (uint16_t)fields[1];
+    record->hum_pct = (uint8_t)fields[2];
+    record->battery_v_x10 = (uint8_t)fields[3];
+}
+
+static uint32_t zigzag(uint32_t cur, uint32_t prev, uint8_t width)
+{
+    // Delta taken modulo the field width, so int16 wraps like uint16
+    int32_t delta = (int32_t)(cur - prev);
+    if (width < 32) {
+        delta = (int32_t)((uint32_t)delta << (32 - width)) >> (32 - width);
+    }
+    return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+static uint32_t unzigzag(uint32_t z, uint32_t prev, uint8_t width)
+{
+    int32_t delta = (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+    return (prev + (uint32_t)delta) & ((1U << width) - 1);
+}
+
+static uint32_t field_bits(uint32_t z, uint8_t width)
+{
+    if (z == 0) {
+        return 1;
+    } else if (z <= SMALL_MAX) {
+        return 2 + SMALL_BITS;
+    } else if (z <= MEDIUM_MAX) {
+        return 3 + MEDIUM_BITS;
+    }
+    return 3 + width;
+}
+
+static void put_bits(codec_writer_t *w, uint32_t value, uint8_t bits)
+{
+    while (bits--) {
+        uint8_t mask = 0x80 >> (w->pos & 7);
+        if (value & BIT(bits)) {
+            w->buf[w->pos >> 3] |= mask;
+        } else {
+            w->buf[w->pos >> 3] &= ~mask;
+        }
+        w->pos++;
+    }
+}
+
+static int get_bits(codec_reader_t *r, uint8_t bits, uint32_t *value)
+{
+    if (r->pos + bits > r->size_bits) {
+        return -EINVAL;
+    }
+
+    uint32_t v = 0;
+    while (bits--) {
+        v = (v << 1) | ((r->buf[r->pos >> 3] >> (7 - (r->pos & 7))) & 1);
+        r->pos++;
+    }
+    *value = v;
+    return 0;
+}
+
+uint32_t record_codec_bits(const sensor_record_t *prev, const sensor_record_t *record)
+{
+    if (!prev) {
+        return 48;
+    }
+
+    uint32_t cur[FIELD_COUNT];
+    uint32_t old[FIELD_COUNT];
+    uint32_t total = 0;
+    get_fields(record, cur);
+    get_fields(prev, old);
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        total += field_bits(zigzag(cur[i], old[i], field_width[i]), field_width[i]);
+    }
+    return total;
+}
+
+int record_codec_encode(codec_writer_t *w, const sensor_record_t *prev,
+                        const sensor_record_t *record)
+{
+    uint32_t cur[FIELD_COUNT];
+    get_fields(record, cur);
+
+    if (!prev) {
+        if (w->pos + 48 > w->size_bits) {
+            return -ENOSPC;
+        }
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            put_bits(w, cur[i], field_width[i]);
+        }
+        return 0;
+    }
+
+    uint32_t old[FIELD_COUNT];
+    uint32_t z[FIELD_COUNT];
+    uint32_t total = 0;
+    get_fields(prev, old);
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        z[i] = zigzag(cur[i], old[i], field_width[i]);
+        total += field_bits(z[i], field_width[i]);
+    }
+    if (w->pos + total > w->size_bits) {
+        return -ENOSPC;
+    }
+
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        if (z[i] == 0) {
+            put_bits(w, 0x0, 1);
+        } else if (z[i] <= SMALL_MAX) {
+            put_bits(w, 0x2, 2);
+            put_bits(w, z[i] - 1, SMALL_BITS);
+        } else if (z[i] <= MEDIUM_MAX) {
+            put_bits(w, 0x6, 3);
+            put_bits(w, z[i] - SMALL_MAX - 1, MEDIUM_BITS);
+        } else {
+            put_bits(w, 0x7, 3);
+            put_bits(w, cur[i], field_width[i]);
+        }
+    }
+    return 0;
+}
+
+int record_codec_decode(codec_reader_t *r, const sensor_record_t *prev,
+                        sensor_record_t *record)
+{
+    uint32_t cur[FIELD_COUNT];
+    int err;
+
+    if (!prev) {
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            err = get_bits(r, field_width[i], &cur[i]);
+            if (err) {
+                return err;
+            }
+        }
+        set_fields(record, cur);
+        return 0;
+    }
+
+    uint32_t old[FIELD_COUNT];
+    get_fields(prev, old);
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        uint32_t prefix = 0;
+        uint32_t value;
+
+        // Count leading ones of the prefix (at most three)
+        while (prefix < 3) {
+            err = get_bits(r, 1, &value);
+            if (err) {
+                return err;
+            }
+            if (value == 0) {
+                break;
+            }
+            prefix++;
+        }
+
+        switch (prefix) {
+        case 0:
+            cur[i] = old[i];
+            break;
+        case 1:
+            err = get_bits(r, SMALL_BITS, &value);
+            cur[i] = unzigzag(value + 1, old[i], field_width[i]);
+            break;
+        case 2:
+            err = get_bits(r, MEDIUM_BITS, &value);
+            cur[i] = unzigzag(value + SMALL_MAX + 1, old[i], field_width[i]);
+            break;
+        default:
+            err = get_bits(r, field_width[i], &cur[i]);
+            break;
+        }
+        if (err) {
+            return err;
+        }
+    }
+
+    set_fields(record, cur);
+    return 0;
+}
+
+#define BENCH_RECORDS 512
+
+void record_codec_benchmark(void)
+{
+    static sensor_record_t input[BENCH_RECORDS];
+    static uint8_t encoded[BENCH_RECORDS * sizeof(sensor_record_t) * 2];
+    sensor_record_t prev = { .temp_x10 = 215, .press_kpa = 1002, .hum_pct = 55, .battery_v_x10 = 37 };
+    uint32_t seed = 12345;
+
+    // Slow random walk, like consecutive samples taken 10 s apart
+    for (int i = 0; i < BENCH_RECORDS; i++) {
+        seed = seed * 1103515245U + 12345U;
+        prev.temp_x10 += (int16_t)((seed >> 16) % 5) - 2;
+        if (((seed >> 8) & 0x7) == 0) {
+            prev.press_kpa += ((seed >> 4) & 1) ? 1 : -1;
+        }
+        if (((seed >> 12) & 0x3) == 0) {
+            prev.hum_pct += ((seed >> 3) & 1) ? 1 : -1;
+        }
+        if (((seed >> 20) & 0xFF) == 0) {
+            prev.battery_v_x10--;
+        }
+        input[i] = prev;
+    }
+
+    codec_writer_t w = { .buf = encoded, .size_bits = sizeof(encoded) * 8, .pos = 0 };
+    uint32_t start = k_cycle_get_32();
+    for (int i = 0; i < BENCH_RECORDS; i++) {
+        record_codec_encode(&w, i ? &input[i - 1] : NULL, &input[i]);
+    }
+    uint32_t encode_cycles = k_cycle_get_32() - start;
+
+    codec_reader_t r = { .buf = encoded, .size_bits = w.pos, .pos = 0 };
+    sensor_record_t decoded;
+    sensor_record_t last;
+    uint32_t mismatches = 0;
+    start = k_cycle_get_32();
+    for (int i = 0; i < BENCH_RECORDS; i++) {
+        record_codec_decode(&r, i ? &last : NULL, &decoded);
+        last = decoded;
+        if (memcmp(&decoded, &input[i], sizeof(decoded)) != 0) {
+            mismatches++;
+        }
+    }
+    uint32_t decode_cycles = k_cycle_get_32() - start;
+
+    uint32_t raw_bytes = BENCH_RECORDS * sizeof(sensor_record_t);
+    uint32_t coded_bytes = DIV_ROUND_UP(w.pos, 8);
+    LOG_INF("Codec: %u records, %u -> %u bytes (x%u.%02u), mismatches %u",
+            BENCH_RECORDS, raw_bytes, coded_bytes, raw_bytes / coded_bytes,
+            (raw_bytes % coded_bytes) * 100 / coded_bytes, mismatches);
+    LOG_INF("Codec: encode %u cycles/record, decode %u cycles/record",
+            encode_cycles / BENCH_RECORDS, decode_cycles / BENCH_RECORDS);
+}
@@ -0,0 +1,39 @@
+#ifndef RECORD_CODEC_H
+#define RECORD_CODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "storage.h"
+
+// Bit stream over a byte buffer (MSB first)
+typedef struct {
+    uint8_t *buf;
+    uint32_t size_bits;      // Capacity in bits
+    uint32_t pos;            // Next bit to write
+} codec_writer_t;
+
+typedef struct {
+    const uint8_t *buf;
+    uint32_t size_bits;      // Readable bits
+    uint32_t pos;            // Next bit to read
+} codec_reader_t;
+
+// Longest encoding of one record: every field escaped to its raw value
+#define RECORD_CODEC_MAX_BITS (4 * 3 + 48)
+
+// Bits record_codec_encode() needs for a record (prev as for encoding)
+uint32_t record_codec_bits(const sensor_record_t *prev, const sensor_record_t *record);
+
+// Encode a record as a delta from prev, or as a full keyframe when prev is NULL.
+// Returns -ENOSPC (writer unchanged) if the record does not fit.
+int record_codec_encode(codec_writer_t *w, const sensor_record_t *prev,
+                        const sensor_record_t *record);
+
+// Decode one record; prev must be the previously decoded record or NULL for a keyframe
+int record_codec_decode(codec_reader_t *r, const sensor_record_t *prev,
+                        sensor_record_t *record);
+
+// Measure encode/decode cost per record and compression ratio, results go to the log
+void record_codec_benchmark(void);
+
+#endif // RECORD_CODEC_H
@@ -0,0 +1,721 @@
+#include "rollup.h"
+#include "config.h"
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/logging/log.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(rollup, LOG_LEVEL_INF);
+
+#ifdef USE_PARTITION_MANAGER
+#ifdef PM_rollup_storage_ID
+#define ROLLUP_PARTITION_ID FIXED_PARTITION_ID(rollup_storage)
+#endif
+#elif FIXED_PARTITION_EXISTS(rollup_storage)
+#define ROLLUP_PARTITION_ID FIXED_PARTITION_ID(rollup_storage)
+#endif
+
+// Records per "hour" period: a block of records, see rollup.h
+#define RECORDS_PER_HOUR (3600 / SENSOR_READ_INTERVAL_SEC)
+#define HOURS_PER_DAY 24
+BUILD_ASSERT(3600 % SENSOR_READ_INTERVAL_SEC == 0,
+             "Rollup hours need a whole number of records");
+BUILD_ASSERT(RECORDS_PER_HOUR * HOURS_PER_DAY <= UINT16_MAX,
+             "Daily record count must fit rollup_entry_t.count");
+
+#define FIELD_COUNT 4
+#define PAGE_NONE UINT32_MAX
+#define PERIOD_NONE UINT32_MAX
+
+// The partition holds two rings of pages, hourly entries first and the last
+// ROLLUP_DAILY_PAGES for daily ones. Page layout:
+// [rollup_page_header_t][slot][slot]..., a slot being [rollup_entry_t][crc]
+// padded to the write block. The slot CRC is seeded with the page_seq, so
+// entries left over from an earlier use of the page (RRAM is not erased)
+// are not mistaken for new ones.
+#define ROLLUP_MAGIC 0x524F4C31      // "ROL1"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t page_seq;       // Increments each time a page of the ring is opened
+    uint32_t crc;            // CRC of the fields above
+} rollup_page_header_t;
+
+typedef struct __attribute__((packed)) {
+    rollup_entry_t entry;
+    uint32_t crc;
+} rollup_slot_t;
+
+typedef struct {
+    uint32_t first_page;     // First partition page of the ring
+    uint32_t pages;          // Pages in the ring
+    uint32_t head_page;      // Ring page open for appends (PAGE_NONE: ring empty)
+    uint32_t head_seq;       // page_seq of the head page
+    uint32_t head_slot;      // Next free slot of the head page
+    uint32_t last_period;    // Period of the newest stored entry
+} rollup_ring_t;
+
+// Running summary of an open period
+typedef struct {
+    uint32_t period;
+    uint32_t count;          // 0 = no records yet
+    int32_t min[FIELD_COUNT];
+    int32_t max[FIELD_COUNT];
+    int64_t sum[FIELD_COUNT];
+} rollup_acc_t;
+
+static const struct flash_area *rollup_area;
+static bool enabled;
+static bool erase_needed = true;
+static uint32_t page_size;
+static uint32_t write_align = 4;
+static uint32_t header_size;          // Page header padded to the write block
+static uint32_t slot_size;            // Slot padded to the write block
+static uint32_t slots_per_page;
+static rollup_ring_t rings[2];
+
+// Guards rings and flash access; rollup_add() never takes it
+static K_MUTEX_DEFINE(rollup_mutex);
+
+// Open periods, updated by the producer and read by rollup_get_open()
+static rollup_acc_t open_acc[2];
+static struct k_spinlock acc_lock;
+
+// Closed periods waiting for rollup_commit(): single producer (rollup_add),
+// single consumer (storage thread)
+#define PENDING_SIZE 4
+static struct {
+    rollup_kind_t kind;
+    rollup_entry_t entry;
+} pending[PENDING_SIZE];
+static atomic_t pending_head = ATOMIC_INIT(0);
+static atomic_t pending_tail = ATOMIC_INIT(0);
+
+// Slot or page header being programmed (at most 16-byte write blocks)
+static uint8_t write_slot[ROUND_UP(sizeof(rollup_slot_t), 16)];
+
+static void record_fields(const sensor_record_t *record, int32_t fields[FIELD_COUNT])
+{
+    fields[0] = record->temp_x10;
+    fields[1] = record->press_kpa;
+    fields[2] = record->hum_pct;
+    fields[3] = record->battery_v_x10;
+}
+
+static void fields_record(const int32_t fields[FIELD_COUNT], sensor_record_t *record)
+{
+    record->temp_x10 = (int16_t)fields[0];
+    record->press_kpa = (uint16_t)fields[1];
+    record->hum_pct = (uint8_t)fields[2];
+    record->battery_v_x10 = (uint8_t)fields[3];
+}
+
+// Fold count records with the given per-field minimum, maximum and sum into acc
+static void acc_merge(rollup_acc_t *acc, uint32_t period, uint32_t count,
+                      const int32_t min[FIELD_COUNT], const int32_t max[FIELD_COUNT],
+                      const int32_t sum[FIELD_COUNT])
+{
+    if (acc->count == 0) {
+        acc->period = period;
+        memcpy(acc->min, min, sizeof(acc->min));
+        memcpy(acc->max, max, sizeof(acc->max));
+        memset(acc->sum, 0, sizeof(acc->sum));
+    }
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        acc->min[i] = MIN(acc->min[i], min[i]);
+        acc->max[i] = MAX(acc->max[i], max[i]);
+        acc->sum[i] += sum[i];
+    }
+    acc->count += count;
+}
+
+static void acc_add_record(rollup_acc_t *acc, uint32_t period, const sensor_record_t *record)
+{
+    int32_t fields[FIELD_COUNT];
+    record_fields(record, fields);
+    acc_merge(acc, period, 1, fields, fields, fields);
+}
+
+// Fold a stored entry back in; the sum is rebuilt from the rounded mean
+static void acc_add_entry(rollup_acc_t *acc, uint32_t period, const rollup_entry_t *entry)
+{
+    int32_t min[FIELD_COUNT];
+    int32_t max[FIELD_COUNT];
+    int32_t sum[FIELD_COUNT];
+    record_fields(&entry->min, min);
+    record_fields(&entry->max, max);
+    record_fields(&entry->mean, sum);
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        sum[i] *= entry->count;
+    }
+    acc_merge(acc, period, entry->count, min, max, sum);
+}
+
+static void acc_mean(const rollup_acc_t *acc, sensor_record_t *record)
+{
+    int32_t mean[FIELD_COUNT];
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        // Round to nearest, also for negative temperatures
+        int64_t half = acc->count / 2;
+        mean[i] = (int32_t)((acc->sum[i] + (acc->sum[i] < 0 ? -half : half)) /
+                            (int64_t)acc->count);
+    }
+    fields_record(mean, record);
+}
+
+static void acc_to_entry(const rollup_acc_t *acc, rollup_entry_t *entry)
+{
+    entry->period = acc->period;
+    entry->count = (uint16_t)acc->count;
+    fields_record(acc->min, &entry->min);
+    fields_record(acc->max, &entry->max);
+    acc_mean(acc, &entry->mean);
+}
+
+static uint32_t page_offset(const rollup_ring_t *ring, uint32_t page)
+{
+    return (ring->first_page + page) * page_size;
+}
+
+static int read_header(const rollup_ring_t *ring, uint32_t page, rollup_page_header_t *hdr)
+{
+    int err = flash_area_read(rollup_area, page_offset(ring, page), hdr, sizeof(*hdr));
+    if (err) {
+        return err;
+    }
+    if (hdr->magic != ROLLUP_MAGIC ||
+        hdr->crc != crc32_ieee((const uint8_t *)hdr, offsetof(rollup_page_header_t, crc))) {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+// Read a slot; -ENOENT if it holds no entry written under page_seq
+static int read_slot(const rollup_ring_t *ring, uint32_t page, uint32_t page_seq,
+                     uint32_t slot, rollup_entry_t *entry)
+{
+    rollup_slot_t data;
+    int err = flash_area_read(rollup_area,
+                              page_offset(ring, page) + header_size + slot * slot_size,
+                              &data, sizeof(data));
+    if (err) {
+        return err;
+    }
+    if (data.crc != crc32_ieee_update(page_seq, (const uint8_t *)&data.entry,
+                                      sizeof(data.entry))) {
+        return -ENOENT;
+    }
+    *entry = data.entry;
+    return 0;
+}
+
+static bool slot_blank(const rollup_ring_t *ring, uint32_t page, uint32_t slot)
+{
+    uint8_t data[sizeof(rollup_slot_t)];
+    if (flash_area_read(rollup_area, page_offset(ring, page) + header_size + slot * slot_size,
+                        data, sizeof(data)) != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(data); i++) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Newest entry of a page, -ENOENT if it has none
+static int last_entry_of_page(const rollup_ring_t *ring, uint32_t page, uint32_t page_seq,
+                              uint32_t *slot, rollup_entry_t *entry)
+{
+    for (uint32_t s = slots_per_page; s-- > 0;) {
+        if (read_slot(ring, page, page_seq, s, entry) == 0) {
+            *slot = s;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+// Find the head of a ring from its page headers and the append position in
+// it. A slot torn by a reset is skipped on flash that needs an erase.
+static void recover_ring(rollup_ring_t *ring)
+{
+    rollup_page_header_t hdr;
+
+    ring->head_page = PAGE_NONE;
+    ring->head_slot = 0;
+    ring->last_period = PERIOD_NONE;
+    for (uint32_t page = 0; page < ring->pages; page++) {
+        if (read_header(ring, page, &hdr) == 0 &&
+            (ring->head_page == PAGE_NONE || hdr.page_seq > ring->head_seq)) {
+            ring->head_page = page;
+            ring->head_seq = hdr.page_seq;
+        }
+    }
+    if (ring->head_page == PAGE_NONE) {
+        return;
+    }
+
+    rollup_entry_t entry;
+    uint32_t slot;
+    if (last_entry_of_page(ring, ring->head_page, ring->head_seq, &slot, &entry) == 0) {
+        ring->head_slot = slot + 1;
+        ring->last_period = entry.period;
+    } else {
+        // Head page opened but still empty: the newest entry is on the page before
+        uint32_t prev = (ring->head_page + ring->pages - 1) % ring->pages;
+        if (read_header(ring, prev, &hdr) == 0 && hdr.page_seq == ring->head_seq - 1 &&
+            last_entry_of_page(ring, prev, hdr.page_seq, &slot, &entry) == 0) {
+            ring->last_period = entry.period;
+        }
+    }
+
+    if (erase_needed) {
+        while (ring->head_slot < slots_per_page &&
+               !slot_blank(ring, ring->head_page, ring->head_slot)) {
+            ring->head_slot++;
+        }
+    }
+}
+
+static int ring_open_page(rollup_ring_t *ring)
+{
+    uint32_t page = (ring->head_page == PAGE_NONE) ? 0 : (ring->head_page + 1) % ring->pages;
+    uint32_t page_seq = (ring->head_page == PAGE_NONE) ? 0 : ring->head_seq + 1;
+    int err;
+
+    if (erase_needed) {
+        err = flash_area_erase(rollup_area, page_offset(ring, page), page_size);
+        if (err) {
+            return err;
+        }
+    }
+
+    rollup_page_header_t hdr = {
+        .magic = ROLLUP_MAGIC,
+        .page_seq = page_seq,
+    };
+    hdr.crc = crc32_ieee((const uint8_t *)&hdr, offsetof(rollup_page_header_t, crc));
+    memset(write_slot, 0xFF, header_size);
+    memcpy(write_slot, &hdr, sizeof(hdr));
+    err = flash_area_write(rollup_area, page_offset(ring, page), write_slot, header_size);
+    if (err) {
+        return err;
+    }
+
+    ring->head_page = page;
+    ring->head_seq = page_seq;
+    ring->head_slot = 0;
+    return 0;
+}
+
+static int ring_append(rollup_ring_t *ring, const rollup_entry_t *entry)
+{
+    if (ring->head_page == PAGE_NONE || ring->head_slot >= slots_per_page) {
+        int err = ring_open_page(ring);
+        if (err) {
+            return err;
+        }
+    }
+
+    rollup_slot_t slot = {
+        .entry = *entry,
+        .crc = crc32_ieee_update(ring->head_seq, (const uint8_t *)entry, sizeof(*entry)),
+    };
+    memset(write_slot, 0xFF, slot_size);
+    memcpy(write_slot, &slot, sizeof(slot));
+    int err = flash_area_write(rollup_area,
+                               page_offset(ring, ring->head_page) + header_size +
+                               ring->head_slot * slot_size,
+                               write_slot, slot_size);
+    // A failed slot may be partly programmed: never reuse it
+    ring->head_slot++;
+    if (err) {
+        return err;
+    }
+    ring->last_period = entry->period;
+    return 0;
+}
+
+// Copy entries of a ring, oldest page first. Called with rollup_mutex held.
+static int ring_read(const rollup_ring_t *ring, uint32_t from_period, rollup_entry_t *entries,
+                     uint32_t max)
+{
+    uint32_t n = 0;
+
+    if (ring->head_page == PAGE_NONE) {
+        return 0;
+    }
+
+    for (uint32_t i = 1; i <= ring->pages && n < max; i++) {
+        uint32_t page = (ring->head_page + i) % ring->pages;
+        rollup_page_header_t hdr;
+        if (read_header(ring, page, &hdr) != 0 || hdr.page_seq > ring->head_seq) {
+            continue;
+        }
+        uint32_t slots = (page == ring->head_page) ? ring->head_slot : slots_per_page;
+        for (uint32_t s = 0; s < slots && n < max; s++) {
+            if (read_slot(ring, page, hdr.page_seq, s, &entries[n]) == 0 &&
+                entries[n].period >= from_period) {
+                n++;
+            }
+        }
+    }
+    return (int)n;
+}
+
+// Queue the summary of a closed period for rollup_commit()
+static bool close_period(rollup_kind_t kind, const rollup_acc_t *acc)
+{
+    uint32_t head = (uint32_t)atomic_get(&pending_head);
+    if (head - (uint32_t)atomic_get(&pending_tail) >= PENDING_SIZE) {
+        LOG_WRN("Rollup queue full, %s period %u lost",
+                kind == ROLLUP_HOURLY ? "hourly" : "daily", acc->period);
+        return false;
+    }
+
+    pending[head % PENDING_SIZE].kind = kind;
+    acc_to_entry(acc, &pending[head % PENDING_SIZE].entry);
+    atomic_set(&pending_head, head + 1);
+    return true;
+}
+
+bool rollup_add(uint32_t seq, const sensor_record_t *record)
+{
+    if (!enabled) {
+        return false;
+    }
+
+    uint32_t periods[2] = {
+        [ROLLUP_HOURLY] = seq / RECORDS_PER_HOUR,
+        [ROLLUP_DAILY] = seq / RECORDS_PER_HOUR / HOURS_PER_DAY,
+    };
+    bool closed = false;
+
+    for (int kind = ROLLUP_HOURLY; kind <= ROLLUP_DAILY; kind++) {
+        k_spinlock_key_t key = k_spin_lock(&acc_lock);
+        rollup_acc_t *acc = &open_acc[kind];
+        if (acc->count > 0 && acc->period != periods[kind]) {
+            k_spin_unlock(&acc_lock, key);
+            closed |= close_period(kind, acc);
+            key = k_spin_lock(&acc_lock);
+            acc->count = 0;
+        }
+        acc_add_record(acc, periods[kind], record);
+        k_spin_unlock(&acc_lock, key);
+    }
+
+    // Closed periods normally wait for the next flush; ask for a commit
+    // before the queue runs out
+    return closed && ((uint32_t)atomic_get(&pending_head) -
+                      (uint32_t)atomic_get(&pending_tail)) >= PENDING_SIZE / 2;
+}
+
+// Store the queued entries. Called with rollup_mutex held.
+static int commit_pending(void)
+{
+    uint32_t tail = (uint32_t)atomic_get(&pending_tail);
+
+    while (tail != (uint32_t)atomic_get(&pending_head)) {
+        int err = ring_append(&rings[pending[tail % PENDING_SIZE].kind],
+                              &pending[tail % PENDING_SIZE].entry);
+        if (err) {
+            LOG_ERR("Rollup write failed: %d", err);
+            return err;
+        }
+        atomic_set(&pending_tail, ++tail);
+    }
+    return 0;
+}
+
+int rollup_commit(void)
+{
+    if (!enabled) {
+        return 0;
+    }
+
+    k_mutex_lock(&rollup_mutex, K_FOREVER);
+    int err = commit_pending();
+    k_mutex_unlock(&rollup_mutex);
+    return err;
+}
+
+int rollup_read(rollup_kind_t kind, uint32_t from_period, rollup_entry_t *entries,
+                uint32_t max)
+{
+    if (!enabled || kind > ROLLUP_DAILY || !entries) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&rollup_mutex, K_FOREVER);
+    int n = ring_read(&rings[kind], from_period, entries, max);
+    k_mutex_unlock(&rollup_mutex);
+    return n;
+}
+
+int rollup_get_open(rollup_kind_t kind, rollup_entry_t *entry)
+{
+    if (!enabled || kind > ROLLUP_DAILY || !entry) {
+        return -EINVAL;
+    }
+
+    int err = 0;
+    k_spinlock_key_t key = k_spin_lock(&acc_lock);
+    if (open_acc[kind].count == 0) {
+        err = -ENODATA;
+    } else {
+        acc_to_entry(&open_acc[kind], entry);
+    }
+    k_spin_unlock(&acc_lock, key);
+    return err;
+}
+
+// Stored entries of one kind, read a few at a time in period order
+typedef struct {
+    rollup_kind_t kind;
+    uint32_t n;              // Entries in buf
+    uint32_t i;              // Next entry of buf to look at
+    bool end;                // No stored entries past buf
+    rollup_entry_t buf[4];
+} entry_stream_t;
+
+// Stored entry for a period, NULL if there is none. Periods must be asked
+// for in increasing order.
+static const rollup_entry_t *stream_find(entry_stream_t *stream, uint32_t period)
+{
+    while (true) {
+        while (stream->i < stream->n && stream->buf[stream->i].period < period) {
+            stream->i++;
+        }
+        if (stream->i < stream->n) {
+            return (stream->buf[stream->i].period == period) ? &stream->buf[stream->i] : NULL;
+        }
+        if (stream->end || !enabled) {
+            return NULL;
+        }
+
+        k_mutex_lock(&rollup_mutex, K_FOREVER);
+        int n = ring_read(&rings[stream->kind], period, stream->buf, ARRAY_SIZE(stream->buf));
+        k_mutex_unlock(&rollup_mutex);
+        stream->n = MAX(n, 0);
+        stream->i = 0;
+        stream->end = (stream->n < ARRAY_SIZE(stream->buf));
+    }
+}
+
+// Fold the records [from_seq, to_seq) still in the raw log into acc
+static int acc_add_raw(rollup_acc_t *acc, uint32_t from_seq, uint32_t to_seq)
+{
+    storage_cursor_t cursor;
+
+    storage_cursor_open(&cursor, MAX(from_seq, storage_get_first_seq()));
+    while (cursor.next_seq < to_seq) {
+        const sensor_record_t *records;
+        uint32_t count;
+        int err = storage_cursor_next_batch(&cursor, &records, to_seq - cursor.next_seq,
+                                            &count);
+        if (err == -EOVERFLOW) {
+            continue;
+        }
+        if (err) {
+            return err;
+        }
+        if (count == 0) {
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            acc_add_record(acc, 0, &records[i]);
+        }
+    }
+    return 0;
+}
+
+int rollup_aggregate(uint32_t from_seq, uint32_t to_seq, rollup_stats_t *stats)
+{
+    if (!stats || from_seq >= to_seq) {
+        return -EINVAL;
+    }
+
+    entry_stream_t days = { .kind = ROLLUP_DAILY };
+    entry_stream_t hours = { .kind = ROLLUP_HOURLY };
+    rollup_acc_t acc = { 0 };
+    uint32_t seq = from_seq;
+
+    to_seq = MIN(to_seq, storage_get_next_seq());
+    while (seq < to_seq) {
+        // Whole days and hours in the range come from their stored entries,
+        // everything else from raw records
+        const rollup_entry_t *entry = NULL;
+        uint32_t span = RECORDS_PER_HOUR * HOURS_PER_DAY;
+        if (seq % span == 0 && to_seq - seq >= span) {
+            entry = stream_find(&days, seq / span);
+        }
+        if (!entry && seq % RECORDS_PER_HOUR == 0 && to_seq - seq >= RECORDS_PER_HOUR) {
+            span = RECORDS_PER_HOUR;
+            entry = stream_find(&hours, seq / span);
+        }
+        if (entry) {
+            acc_add_entry(&acc, 0, entry);
+            seq += span;
+            continue;
+        }
+
+        uint32_t end = MIN(to_seq, ROUND_DOWN(seq, RECORDS_PER_HOUR) + RECORDS_PER_HOUR);
+        int err = acc_add_raw(&acc, seq, end);
+        if (err) {
+            return err;
+        }
+        seq = end;
+    }
+
+    if (acc.count == 0) {
+        return -ENODATA;
+    }
+    stats->count = acc.count;
+    fields_record(acc.min, &stats->min);
+    fields_record(acc.max, &stats->max);
+    acc_mean(&acc, &stats->mean);
+    return 0;
+}
+
+// Fold the stored hourly entries of a day into acc
+static void merge_stored_hours(uint32_t day, rollup_acc_t *acc)
+{
+    rollup_entry_t entries[8];
+    uint32_t from = day * HOURS_PER_DAY;
+
+    while (true) {
+        int n = ring_read(&rings[ROLLUP_HOURLY], from, entries, ARRAY_SIZE(entries));
+        for (int i = 0; i < n; i++) {
+            if (entries[i].period / HOURS_PER_DAY != day) {
+                return;
+            }
+            acc_add_entry(acc, day, &entries[i]);
+            from = entries[i].period + 1;
+        }
+        if (n < (int)ARRAY_SIZE(entries)) {
+            return;
+        }
+    }
+}
+
+// Bring the rings up to date after a reset: daily entries are rebuilt from
+// stored hourly ones, hourly entries and the open periods from raw records.
+// Called with rollup_mutex held.
+static void catch_up(void)
+{
+    rollup_ring_t *hourly = &rings[ROLLUP_HOURLY];
+    rollup_ring_t *daily = &rings[ROLLUP_DAILY];
+    uint32_t next_seq = storage_get_next_seq();
+    uint32_t from_hour = (hourly->last_period == PERIOD_NONE) ? 0 : hourly->last_period + 1;
+    uint32_t from_seq = MAX(from_hour * RECORDS_PER_HOUR, storage_get_first_seq());
+    uint32_t today = from_seq / RECORDS_PER_HOUR / HOURS_PER_DAY;
+
+    // Days whose hours were stored but whose daily entry was lost
+    rollup_entry_t oldest;
+    if (ring_read(hourly, 0, &oldest, 1) == 1) {
+        uint32_t day = (daily->last_period == PERIOD_NONE) ?
+                       oldest.period / HOURS_PER_DAY : daily->last_period + 1;
+        for (; day < today; day++) {
+            rollup_acc_t acc = { 0 };
+            merge_stored_hours(day, &acc);
+            if (acc.count > 0) {
+                rollup_entry_t entry;
+                acc_to_entry(&acc, &entry);
+                (void)ring_append(daily, &entry);
+            }
+        }
+    }
+
+    // The open day starts with its stored hours
+    if (daily->last_period == PERIOD_NONE || daily->last_period < today) {
+        merge_stored_hours(today, &open_acc[ROLLUP_DAILY]);
+    }
+
+    // Raw records not covered by a stored hour
+    enabled = true;
+    storage_cursor_t cursor;
+    storage_cursor_open(&cursor, from_seq);
+    while (cursor.next_seq < next_seq) {
+        const sensor_record_t *records;
+        uint32_t count;
+        int err = storage_cursor_next_batch(&cursor, &records, next_seq - cursor.next_seq,
+                                            &count);
+        if (err == -EOVERFLOW) {
+            continue;
+        }
+        if (err || count == 0) {
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (rollup_add(cursor.next_seq - count + i, &records[i])) {
+                (void)commit_pending();
+            }
+        }
+    }
+    (void)commit_pending();
+    LOG_INF("Rollups caught up from record %u (hour %u)", from_seq,
+            from_seq / RECORDS_PER_HOUR);
+}
+
+int rollup_init(void)
+{
+#ifndef ROLLUP_PARTITION_ID
+    LOG_WRN("No rollup_storage partition, rollups disabled");
+    return -ENODEV;
+#else
+    int err = flash_area_open(ROLLUP_PARTITION_ID, &rollup_area);
+    if (err) {
+        LOG_ERR("Failed to open rollup partition: %d", err);
+        return err;
+    }
+
+    const struct device *dev = flash_area_get_device(rollup_area);
+    struct flash_pages_info info;
+    err = flash_get_page_info_by_offs(dev, rollup_area->fa_off, &info);
+    if (err) {
+        LOG_ERR("Failed to get page info for rollup partition: %d", err);
+        return err;
+    }
+    page_size = info.size;
+    uint32_t page_count = rollup_area->fa_size / page_size;
+
+    const struct flash_parameters *params = flash_get_parameters(dev);
+    erase_needed = (flash_params_get_erase_cap(params) & FLASH_ERASE_C_EXPLICIT) != 0;
+    write_align = MAX(flash_area_align(rollup_area), 1U);
+    header_size = ROUND_UP(sizeof(rollup_page_header_t), write_align);
+    slot_size = ROUND_UP(sizeof(rollup_slot_t), write_align);
+    if (slot_size > sizeof(write_slot) || header_size > sizeof(write_slot)) {
+        LOG_ERR("Write block %u too large for rollups", write_align);
+        return -ENOTSUP;
+    }
+    if (page_count < ROLLUP_DAILY_PAGES + 2 || page_size < header_size + slot_size) {
+        LOG_ERR("Rollup partition too small: %u pages of %u bytes", page_count, page_size);
+        return -ENOSPC;
+    }
+    slots_per_page = (page_size - header_size) / slot_size;
+
+    rings[ROLLUP_HOURLY].first_page = 0;
+    rings[ROLLUP_HOURLY].pages = page_count - ROLLUP_DAILY_PAGES;
+    rings[ROLLUP_DAILY].first_page = page_count - ROLLUP_DAILY_PAGES;
+    rings[ROLLUP_DAILY].pages = ROLLUP_DAILY_PAGES;
+
+    k_mutex_lock(&rollup_mutex, K_FOREVER);
+    recover_ring(&rings[ROLLUP_HOURLY]);
+    recover_ring(&rings[ROLLUP_DAILY]);
+    catch_up();
+    k_mutex_unlock(&rollup_mutex);
+
+    LOG_INF("Rollups: %u hours, %u days of history",
+            (rings[ROLLUP_HOURLY].pages - 1) * slots_per_page,
+            (rings[ROLLUP_DAILY].pages - 1) * slots_per_page);
+    return 0;
+#endif
+}
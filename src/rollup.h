@@ -0,0 +1,67 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "storage.h"
+
+// Second storage tier: "hourly" and "daily" summaries of the record stream,
+// kept in the rollup_storage partition after the raw records are overwritten.
+// Periods are blocks of records, not clock time: an hourly period is a block
+// of 3600 / SENSOR_READ_INTERVAL_SEC records (360 at 10 s) numbered from
+// record 0 (period = seq / 360), a daily period a block of 24 of those. A
+// block spans an hour only while every sample was stored; records missed
+// while the node was off, dropped or downsampled stretch it over a longer
+// time. The log's time markers (storage_cursor_time()) give the real times.
+
+typedef enum {
+    ROLLUP_HOURLY = 0,
+    ROLLUP_DAILY = 1,
+} rollup_kind_t;
+
+// Per-field minimum, maximum and mean of one period
+typedef struct __attribute__((packed)) {
+    uint32_t period;         // Block number: seq / records per block
+    uint16_t count;          // Records in the period
+    sensor_record_t min;
+    sensor_record_t max;
+    sensor_record_t mean;
+} rollup_entry_t;
+
+// Open the rollup partition and roll up the raw records written since the
+// last stored period. Called by storage_init() once the log is readable.
+int rollup_init(void);
+
+// Add a record to the open periods. Called by storage_write() without
+// touching flash; closed periods are stored by the next rollup_commit().
+// Returns true when enough are queued that the commit should not wait.
+bool rollup_add(uint32_t seq, const sensor_record_t *record);
+
+// Store closed periods; called from the storage thread
+int rollup_commit(void);
+
+// Copy up to max stored entries of a kind, oldest first, starting with the
+// first period >= from_period. Returns the number of entries copied.
+int rollup_read(rollup_kind_t kind, uint32_t from_period, rollup_entry_t *entries,
+                uint32_t max);
+
+// Summary of the open period of a kind, -ENODATA if it has no records yet
+int rollup_get_open(rollup_kind_t kind, rollup_entry_t *entry);
+
+// Per-field minimum, maximum and mean over a range of records
+typedef struct {
+    uint32_t count;
+    sensor_record_t min;
+    sensor_record_t max;
+    sensor_record_t mean;
+} rollup_stats_t;
+
+// Summarize the records [from_seq, to_seq). Whole day and hour blocks in the
+// range are taken from their stored entries, so older data is covered after
+// its raw records are gone and long ranges read little flash; the rest is
+// read from the raw log. Means of stored periods are rounded, so the mean
+// can differ from that of the raw records by a fraction of a unit.
+// Returns -ENODATA if no record of the range is left.
+int rollup_aggregate(uint32_t from_seq, uint32_t to_seq, rollup_stats_t *stats);
+
+#endif // ROLLUP_H
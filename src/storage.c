@@ -1,24 +1,61 @@
 #include "storage.h"
 #include "config.h"
+#include "record_codec.h"
+#include "flush_policy.h"
+#include "rollup.h"
+#include "meta_bench.h"
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
+#include <zephyr/devicetree.h>
 #include <zephyr/drivers/flash.h>
 #include <zephyr/storage/flash_map.h>
+#if defined(CONFIG_ZMS)
+#include <zephyr/fs/zms.h>
+#else
 #include <zephyr/fs/nvs.h>
+#endif
+#include <zephyr/linker/section_tags.h>
+#include <zephyr/sys/barrier.h>
+#include <zephyr/sys/crc.h>
 #include <zephyr/sys/util.h>
 #include <zephyr/logging/log.h>
+#include <stddef.h>
 #include <string.h>
 
 LOG_MODULE_REGISTER(storage, LOG_LEVEL_DBG);
 
-#define NVS_PARTITION_ID FIXED_PARTITION_ID(nvs_storage)
-#define NVS_SECTOR_SIZE 4096
-#define NVS_SECTOR_COUNT 2  // Minimum 2 sectors for wear leveling
+// Metadata store: ZMS on RRAM (nRF54L), NVS on NOR flash. Both live in the
+// nvs_storage partition and hold a single packed state entry; the log
+// position is recovered from page headers, not stored here.
+#define META_PARTITION_ID FIXED_PARTITION_ID(nvs_storage)
+#define META_SECTOR_COUNT 2  // Minimum 2 sectors for garbage collection
+
+#define META_KEY_LAST_SENT 0x02  // Earlier NVS layout: last_sent_seq alone
+#define META_KEY_STATE 0x03
+
+#define META_STATE_VERSION 1
+
+// At most 8 bytes: ZMS then keeps it inside the allocation table entry, so
+// a checkpoint is a single write block
+typedef struct __attribute__((packed)) {
+    uint32_t last_sent_seq;
+    uint8_t version;
+    uint8_t reserved[3];
+} meta_state_t;
+
+BUILD_ASSERT(sizeof(meta_state_t) <= 8, "State entry must fit a ZMS ATE");
 
-// NVS keys
-#define NVS_KEY_LAST_INDEX 0x01
-#define NVS_KEY_LAST_SENT 0x02
-#define NVS_KEY_WRAPPED 0x03
+#if defined(CONFIG_ZMS)
+static struct zms_fs meta_fs;
+#define meta_mount zms_mount
+#define meta_read zms_read
+#define meta_write zms_write
+#else
+static struct nvs_fs meta_fs;
+#define meta_mount nvs_mount
+#define meta_read nvs_read
+#define meta_write nvs_write
+#endif
 
 // Flash device for data partition
 // For nRF54L15, sensor_storage may not be defined, use nvs_storage as fallback
@@ -35,146 +72,1340 @@ LOG_MODULE_REGISTER(storage, LOG_LEVEL_DBG);
 #endif
 static const struct flash_area *flash_area_data;
 
-// RAM buffer for batching writes
-static sensor_record_t ram_buffer[RAM_BUFFER_SIZE];
-static uint32_t ram_buffer_count = 0;
-static int64_t last_flash_write_time = 0;
+// Internal flash/RRAM of nRF SoCs is memory mapped: cursors parse pages in
+// place instead of copying them through a page buffer
+#if defined(CONFIG_SOC_FLASH_NRF_RRAM) || defined(CONFIG_SOC_FLASH_NRF)
+#define DATA_FLASH_MMAP_BASE DT_REG_ADDR(DT_CHOSEN(zephyr_flash))
+#endif
+
+#define PAGE_NONE UINT32_MAX
+
+// Page layout: [page_header_t][page_seal_t][batch][batch]...
+// The header is programmed when the page is opened, the seal when the page
+// is full. Both start on a write block boundary. The magic tells how the
+// batches of the page are coded; readers handle both formats.
+#define PAGE_MAGIC_RAW 0x4C4F4733    // "LOG3": batches hold raw 6-byte records
+#define PAGE_MAGIC_DELTA 0x4C4F4746  // "LOGF": first record of the page is a
+                                     // keyframe, the rest are coded deltas
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;          // PAGE_MAGIC_RAW or PAGE_MAGIC_DELTA
+    uint32_t page_seq;       // Monotonic page sequence, +1 for every opened page
+    uint32_t first_seq;      // Sequence number of the first record stored in the page
+    uint32_t crc;            // CRC32 of the fields above
+} page_header_t;
+
+// Range of every field over the records of a page (zone map)
+typedef struct __attribute__((packed)) {
+    sensor_record_t min;
+    sensor_record_t max;
+} page_zone_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t record_count;   // Records stored in the page
+    uint32_t crc;            // CRC32 of all batches, seeded with page_seq
+    page_zone_t zone;        // Lets storage_find() skip the page
+    uint32_t zone_crc;       // CRC32 of the fields above, seeded with page_seq
+} page_seal_t;
+
+// On-flash batch framing: every flush appends one batch to the open page,
+// [batch_header_t + payload][batch_commit_t], each part padded to the write
+// block. The commit marker is programmed after the payload, so a batch torn
+// by a reset is never visible to readers or to boot recovery. A batch
+// without records holds a storage_marker_t, uncoded on any page.
+typedef struct __attribute__((packed)) {
+    uint16_t count;          // Records in this batch, 0 = marker
+    uint16_t page_tag;       // Low 16 bits of page_seq, rejects stale batches
+    uint16_t size;           // Payload bytes after the header
+    uint16_t reserved;       // 0xFFFF
+} batch_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t crc;            // CRC32 of header and payload, seeded with page_seq
+} batch_commit_t;
+
+// Staged records live in RAM no startup code clears. With a retained_ram
+// devicetree region (boards/nrf54l15dk.overlay) that is a block at the top
+// of SRAM outside what both the app and MCUboot use (sysbuild/mcuboot.overlay),
+// so a warm reset through the bootloader leaves it alone; plain __noinit
+// RAM otherwise.
+#if DT_NODE_EXISTS(DT_NODELABEL(retained_ram))
+#include <zephyr/linker/devicetree_regions.h>
+#define STAGE_RETAINED \
+    Z_GENERIC_SECTION(LINKER_DT_NODE_REGION_NAME(DT_NODELABEL(retained_ram)))
+#else
+#define STAGE_RETAINED __noinit
+#endif
+
+// RAM staging ring between the sampler and its consumers. Positions are
+// record sequence numbers: storage_write() is the only producer and
+// publishes ring_head, the storage thread commits records to flash and
+// advances ring_tail. Slots below ring_tail may be overwritten at any time,
+// so cursors copy records out and check ring_head afterwards.
+#define STAGE_RING_SIZE (2 * RAM_BUFFER_SIZE)
+static sensor_record_t stage_ring[STAGE_RING_SIZE] STAGE_RETAINED;
+static uint32_t stage_check[STAGE_RING_SIZE] STAGE_RETAINED;  // CRC32 of each slot's record,
+                                                              // seeded with its seq
+static atomic_t ring_head = ATOMIC_INIT(0);   // Sequence number of the next record to stage
+static atomic_t ring_tail = ATOMIC_INIT(0);   // Sequence number of the next record to commit to flash
+static atomic_t flush_err = ATOMIC_INIT(0);   // Result of the last flush attempt
+
+// This header, updated by the producer after every staged record, lets
+// storage_init() take back the records a warm reset (watchdog, fault, soft
+// reset) left uncommitted: those from the end of the log on flash up to
+// head whose slots still pass their check word. The marker not yet on flash
+// is kept with them.
+#define RETAINED_MAGIC 0x53544733    // "STG3"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t ring_size;      // STAGE_RING_SIZE of the firmware that wrote it
+    uint32_t head;           // ring_head; programmed after the record's check word
+    storage_marker_t marker; // Copy of marker_next
+    uint32_t marker_crc;     // CRC32 of marker
+} retained_stage_t;
+
+static volatile retained_stage_t retained STAGE_RETAINED;
+
+// Time markers (storage_marker_t) are batches without records. The producer
+// anchors one on the record it stages when one is due; the storage thread
+// writes it right before that record and repeats the last one at the start
+// of every page, so the time of any record is found within its own page.
+// Guarded by marker_lock.
+static struct k_spinlock marker_lock;
+static storage_marker_t marker_next;     // Anchored, not on flash yet (interval_s 0 = none)
+static storage_marker_t marker_last;     // Last marker written to the log
+static bool marker_due = true;           // Anchor one on the next staged record
+static uint32_t marker_anchor_seq;       // Record the last marker of this boot was anchored on
+static uint32_t marker_interval_s;       // Interval of that marker (downsampling stretches it)
+static uint32_t boot_count;              // One more than the last boot found in the log
+static uint32_t epoch_base_s;            // storage_set_epoch() time, 0 = never set
+static uint32_t epoch_base_uptime_s;     // Uptime at that call
+
+// Flush scheduling: the policy is asked after every staged record
+static storage_flush_policy_t flush_policy = flush_policy_default;
+static atomic_t transfer_active = ATOMIC_INIT(0);
+static uint32_t age_mark_seq;                 // Producer only: staged record whose age is tracked
+static uint32_t age_mark_ms;                  // Uptime when that record was staged
+
+// Ack-driven retention: what happens once unacknowledged records fill the log
+static atomic_t retention = ATOMIC_INIT(STORAGE_RETENTION);
+static atomic_t backpressure = ATOMIC_INIT(STORAGE_BACKPRESSURE_NONE);
+static uint32_t downsample_count;             // Producer only
+
+// Runtime counters (storage_get_stats)
+static atomic_t stat_flushes = ATOMIC_INIT(0);
+static atomic_t stat_bytes = ATOMIC_INIT(0);
+static atomic_t stat_erases = ATOMIC_INIT(0);
+static atomic_t stat_dropped = ATOMIC_INIT(0);
+static atomic_t stat_skipped = ATOMIC_INIT(0);
+static atomic_t stat_unacked_lost = ATOMIC_INIT(0);
+static atomic_t stat_zone_skipped = ATOMIC_INIT(0);
+static atomic_t stat_zone_scanned = ATOMIC_INIT(0);
+static atomic_t stat_seek_hits = ATOMIC_INIT(0);
+static atomic_t stat_seek_misses = ATOMIC_INIT(0);
+
+// Guards the page log state and page images; held by the storage thread
+// while it programs flash, never taken by storage_write()
+static K_MUTEX_DEFINE(log_mutex);
+static K_SEM_DEFINE(flush_sem, 0, 1);
+K_EVENT_DEFINE(storage_events);
+
+// Storage state
+static uint32_t last_sent_seq = 0;
+static uint32_t saved_last_sent = 0;     // last_sent_seq in the metadata store
+static bool wrapped = false;
+static bool initialized = false;
+
+// Append-only log state
+static uint32_t head_page = PAGE_NONE;   // Page currently open for appends (none yet)
+static uint32_t head_page_seq = 0;       // page_seq of the head page
+static uint32_t head_offset = 0;         // Bytes already programmed in head page
+static uint32_t head_records = 0;        // Records stored in head page
+static uint32_t head_crc = 0;            // Running CRC of head page batches
+static bool head_delta = false;          // Head page uses the delta codec
+static sensor_record_t head_last;        // Last record in head page (delta reference)
+static page_zone_t head_zone;            // Zone map of head page records, sealed with it
+static uint32_t tail_page = 0;           // Oldest page still holding records
+static uint32_t oldest_seq = 0;          // First record sequence number of tail page
+static uint32_t page_first_seq[STORAGE_MAX_PAGES];  // Cache, PAGE_NONE = not read yet
+static uint32_t page_size;               // Flash page size, read from the partition at boot
+static uint32_t page_count;              // Pages in the log ring
+static uint32_t write_align = 4;         // Flash write block size
+static uint32_t seal_offset;             // Offset of page_seal_t within a page
+static uint32_t data_offset;             // Offset of the first batch within a page
+static bool erase_needed = true;         // False on RRAM: pages can be programmed without erase
+
+// Programming goes through this small buffer in whole write blocks: page
+// headers and seals, commit markers, delta-coded batches chunk by chunk and
+// the unaligned ends of raw batches. It has room for one more coded record
+// past a full chunk.
+#define WRITE_CHUNK_SIZE 64
+static uint8_t write_chunk[WRITE_CHUNK_SIZE + DIV_ROUND_UP(RECORD_CODEC_MAX_BITS, 8)];
+
+#ifndef DATA_FLASH_MMAP_BASE
+// Page image for cursor reads when flash is not memory mapped
+static uint8_t read_buf[STORAGE_MAX_PAGE_SIZE];
+static uint32_t read_buf_page = PAGE_NONE;
+#endif
+
+#if STORAGE_SEEK_CACHE_SLOTS > 0
+// Positions cursors returned records from, so a cursor opened inside a page
+// (storage_read(), storage_find(), a resumed transfer) starts at the last
+// one at or before its record instead of decoding the page from its start.
+// One slot per page, the least recently used one is replaced. Guarded by
+// log_mutex; a slot is dropped when its page is reopened.
+typedef struct {
+    uint32_t page;
+    uint32_t page_seq;
+    uint32_t batch_offset;
+    uint32_t batch_seq;
+    uint32_t decode_seq;
+    uint32_t decode_bit;
+    sensor_record_t prev;
+    storage_marker_t marker;
+    uint32_t used;           // seek_clock at the last use, 0 = empty
+} seek_point_t;
+
+static seek_point_t seek_cache[STORAGE_SEEK_CACHE_SLOTS];
+static uint32_t seek_clock;
+#endif
+
+// Remember where a cursor is about to return records from
+static void seek_cache_save(const storage_cursor_t *cursor)
+{
+#if STORAGE_SEEK_CACHE_SLOTS > 0
+    seek_point_t *slot = &seek_cache[0];
+    for (int i = 0; i < STORAGE_SEEK_CACHE_SLOTS; i++) {
+        if (seek_cache[i].used && seek_cache[i].page == cursor->page) {
+            slot = &seek_cache[i];
+            break;
+        }
+        if (seek_cache[i].used < slot->used) {
+            slot = &seek_cache[i];
+        }
+    }
+
+    *slot = (seek_point_t){
+        .page = cursor->page,
+        .page_seq = cursor->page_seq,
+        .batch_offset = cursor->batch_offset,
+        .batch_seq = cursor->batch_seq,
+        .decode_seq = cursor->decode_seq,
+        .decode_bit = cursor->decode_bit,
+        .prev = cursor->prev,
+        .marker = cursor->marker,
+        .used = ++seek_clock,
+    };
+#else
+    ARG_UNUSED(cursor);
+#endif
+}
+
+// Position a cursor on page at the remembered position, if there is one at
+// or before seq
+static bool seek_cache_restore(storage_cursor_t *cursor, uint32_t page, uint32_t seq)
+{
+#if STORAGE_SEEK_CACHE_SLOTS > 0
+    for (int i = 0; i < STORAGE_SEEK_CACHE_SLOTS; i++) {
+        seek_point_t *slot = &seek_cache[i];
+        if (slot->used && slot->page == page && slot->decode_seq <= seq) {
+            slot->used = ++seek_clock;
+            cursor->page = page;
+            cursor->page_seq = slot->page_seq;
+            cursor->batch_offset = slot->batch_offset;
+            cursor->batch_seq = slot->batch_seq;
+            cursor->decode_seq = slot->decode_seq;
+            cursor->decode_bit = slot->decode_bit;
+            cursor->prev = slot->prev;
+            cursor->marker = slot->marker;
+            atomic_inc(&stat_seek_hits);
+            return true;
+        }
+    }
+#else
+    ARG_UNUSED(cursor);
+    ARG_UNUSED(page);
+    ARG_UNUSED(seq);
+#endif
+    atomic_inc(&stat_seek_misses);
+    return false;
+}
+
+// Drop the remembered position on a page whose contents changed
+static void seek_cache_forget(uint32_t page)
+{
+#if STORAGE_SEEK_CACHE_SLOTS > 0
+    for (int i = 0; i < STORAGE_SEEK_CACHE_SLOTS; i++) {
+        if (seek_cache[i].page == page) {
+            seek_cache[i].used = 0;
+        }
+    }
+#else
+    ARG_UNUSED(page);
+#endif
+}
+
+static uint32_t commit_size(void)
+{
+    return ROUND_UP(sizeof(batch_commit_t), write_align);
+}
+
+// Flash taken by a batch with size payload bytes, commit marker included
+static uint32_t batch_span(uint32_t size)
+{
+    return ROUND_UP(sizeof(batch_header_t) + size, write_align) + commit_size();
+}
+
+static uint32_t page_count_in_log(void)
+{
+    if (head_page == PAGE_NONE) {
+        return 0;
+    }
+    return (head_page + page_count - tail_page) % page_count + 1;
+}
+
+static int read_page_header(uint32_t page, page_header_t *hdr)
+{
+    int err = flash_area_read(flash_area_data, page * page_size, hdr, sizeof(*hdr));
+    if (err) {
+        return err;
+    }
+
+    if ((hdr->magic != PAGE_MAGIC_RAW && hdr->magic != PAGE_MAGIC_DELTA) ||
+        hdr->crc != crc32_ieee((const uint8_t *)hdr, offsetof(page_header_t, crc))) {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+static int get_page_first_seq(uint32_t page, uint32_t *first_seq)
+{
+    if (page_first_seq[page] == PAGE_NONE) {
+        page_header_t hdr;
+        int err = read_page_header(page, &hdr);
+        if (err) {
+            return err;
+        }
+        page_first_seq[page] = hdr.first_seq;
+    }
+
+    *first_seq = page_first_seq[page];
+    return 0;
+}
+
+int32_t storage_record_field(const sensor_record_t *record, storage_field_t field)
+{
+    switch (field) {
+    case STORAGE_FIELD_TEMP:
+        return record->temp_x10;
+    case STORAGE_FIELD_PRESS:
+        return record->press_kpa;
+    case STORAGE_FIELD_HUM:
+        return record->hum_pct;
+    case STORAGE_FIELD_BATTERY:
+    default:
+        return record->battery_v_x10;
+    }
+}
+
+// Widen a zone map by one record; first starts a new one
+static void zone_add(page_zone_t *zone, bool first, const sensor_record_t *record)
+{
+    if (first) {
+        zone->min = *record;
+        zone->max = *record;
+        return;
+    }
+    zone->min.temp_x10 = MIN(zone->min.temp_x10, record->temp_x10);
+    zone->min.press_kpa = MIN(zone->min.press_kpa, record->press_kpa);
+    zone->min.hum_pct = MIN(zone->min.hum_pct, record->hum_pct);
+    zone->min.battery_v_x10 = MIN(zone->min.battery_v_x10, record->battery_v_x10);
+    zone->max.temp_x10 = MAX(zone->max.temp_x10, record->temp_x10);
+    zone->max.press_kpa = MAX(zone->max.press_kpa, record->press_kpa);
+    zone->max.hum_pct = MAX(zone->max.hum_pct, record->hum_pct);
+    zone->max.battery_v_x10 = MAX(zone->max.battery_v_x10, record->battery_v_x10);
+}
+
+static bool zone_overlaps(const page_zone_t *zone, storage_field_t field, int32_t min,
+                          int32_t max)
+{
+    return storage_record_field(&zone->max, field) >= min &&
+           storage_record_field(&zone->min, field) <= max;
+}
+
+// Zone map of a page holding records; false if it is not known (head page
+// still empty, page not sealed or seal torn by a reset)
+static bool get_page_zone(uint32_t page, page_zone_t *zone)
+{
+    if (page == head_page) {
+        *zone = head_zone;
+        return head_records > 0;
+    }
+
+    page_header_t hdr;
+    page_seal_t seal;
+    if (read_page_header(page, &hdr) != 0 ||
+        flash_area_read(flash_area_data, page * page_size + seal_offset,
+                        &seal, sizeof(seal)) != 0 ||
+        seal.zone_crc != crc32_ieee_update(hdr.page_seq, (const uint8_t *)&seal,
+                                           offsetof(page_seal_t, zone_crc))) {
+        return false;
+    }
+    *zone = seal.zone;
+    return true;
+}
+
+static int flash_seal_page(void)
+{
+    page_seal_t seal = {
+        .record_count = head_records,
+        .crc = head_crc,
+        .zone = head_zone,
+    };
+    seal.zone_crc = crc32_ieee_update(head_page_seq, (const uint8_t *)&seal,
+                                      offsetof(page_seal_t, zone_crc));
+
+    memset(write_chunk, 0xFF, data_offset - seal_offset);
+    memcpy(write_chunk, &seal, sizeof(seal));
+    int err = flash_area_write(flash_area_data, head_page * page_size + seal_offset,
+                               write_chunk, data_offset - seal_offset);
+    if (!err) {
+        atomic_add(&stat_bytes, data_offset - seal_offset);
+    }
+    return err;
+}
+
+static int flash_open_page(uint32_t page)
+{
+    uint32_t page_offset = page * page_size;
+    int err;
+
+    // Opening the tail page drops its records
+    if (head_page != PAGE_NONE && page == tail_page) {
+        tail_page = (tail_page + 1) % page_count;
+        err = get_page_first_seq(tail_page, &oldest_seq);
+        if (err) {
+            return err;
+        }
+        wrapped = true;
+    }
+
+    if (erase_needed) {
+        err = flash_area_erase(flash_area_data, page_offset, page_size);
+        if (err) {
+            return err;
+        }
+        atomic_inc(&stat_erases);
+    }
+
+    uint32_t page_seq = (head_page == PAGE_NONE) ? 0 : head_page_seq + 1;
+    page_header_t hdr = {
+        .magic = STORAGE_CODEC_DELTA ? PAGE_MAGIC_DELTA : PAGE_MAGIC_RAW,
+        .page_seq = page_seq,
+        .first_seq = (uint32_t)atomic_get(&ring_tail),
+    };
+    hdr.crc = crc32_ieee((const uint8_t *)&hdr, offsetof(page_header_t, crc));
+
+    // Header plus a blank seal; on RRAM this also clears any stale seal
+    memset(write_chunk, 0xFF, data_offset);
+    memcpy(write_chunk, &hdr, sizeof(hdr));
+    err = flash_area_write(flash_area_data, page_offset, write_chunk, data_offset);
+    if (err) {
+        return err;
+    }
+    atomic_add(&stat_bytes, data_offset);
+
+#ifndef DATA_FLASH_MMAP_BASE
+    if (read_buf_page == page) {
+        read_buf_page = PAGE_NONE;
+    }
+#endif
+    seek_cache_forget(page);
+
+    head_page = page;
+    head_page_seq = page_seq;
+    head_offset = data_offset;
+    head_records = 0;
+    head_crc = page_seq;
+    head_delta = (hdr.magic == PAGE_MAGIC_DELTA);
+    page_first_seq[page] = hdr.first_seq;
+    return 0;
+}
+
+// Number of staged records the next batch takes, as many as fit in room
+// bytes of the head page, and its payload size. Returns 0 if none fits.
+static uint32_t plan_batch(const sensor_record_t *records, uint32_t count, uint32_t room,
+                           uint32_t *size)
+{
+    uint32_t n = MIN(count, 0xFFFEU);
+
+    if (!head_delta) {
+        if (room < batch_span(sizeof(sensor_record_t))) {
+            return 0;
+        }
+        n = MIN(n, (room - sizeof(batch_header_t)) / sizeof(sensor_record_t));
+        while (batch_span(n * sizeof(sensor_record_t)) > room) {
+            n--;
+        }
+        *size = n * sizeof(sensor_record_t);
+        return n;
+    }
+
+    // room and the commit marker are whole write blocks
+    if (room <= commit_size() + sizeof(batch_header_t)) {
+        return 0;
+    }
+    uint32_t max_bits = (room - commit_size() - sizeof(batch_header_t)) * 8;
+    uint32_t bits = 0;
+    uint32_t i;
+    for (i = 0; i < n; i++) {
+        const sensor_record_t *prev = (i > 0) ? &records[i - 1] :
+                                      (head_records > 0) ? &head_last : NULL;
+        uint32_t record_bits = record_codec_bits(prev, &records[i]);
+        if (bits + record_bits > max_bits) {
+            break;
+        }
+        bits += record_bits;
+    }
+    *size = DIV_ROUND_UP(bits, 8);
+    return i;
+}
+
+// Position of a batch being programmed
+typedef struct {
+    uint32_t offset;         // Flash offset of write_chunk[0]
+    uint32_t fill;           // Bytes gathered in write_chunk
+    uint32_t data_left;      // Header and payload bytes not yet programmed
+    uint32_t commit_crc;     // CRC of the header and payload programmed so far
+    uint32_t page_crc;       // head_crc including everything programmed so far
+} batch_writer_t;
+
+// Program len bytes (whole write blocks) at the writer position
+static int batch_program(batch_writer_t *bw, const void *data, uint32_t len)
+{
+    int err = flash_area_write(flash_area_data, bw->offset, data, len);
+    if (err) {
+        return err;
+    }
+
+    uint32_t data_len = MIN(len, bw->data_left);
+    bw->commit_crc = crc32_ieee_update(bw->commit_crc, data, data_len);
+    bw->data_left -= data_len;
+    bw->page_crc = crc32_ieee_update(bw->page_crc, data, len);
+    bw->offset += len;
+    atomic_add(&stat_bytes, len);
+    return 0;
+}
+
+// Program the first len bytes of write_chunk and keep the rest for later
+static int batch_program_chunk(batch_writer_t *bw, uint32_t len)
+{
+    int err = batch_program(bw, write_chunk, len);
+    if (err) {
+        return err;
+    }
+    bw->fill -= len;
+    memmove(write_chunk, write_chunk + len, bw->fill);
+    return 0;
+}
+
+// Program a batch of n staged records planned by plan_batch() at the append
+// position of the head page, then its commit marker. Raw records are
+// programmed straight from the staging ring; only the header and the
+// unaligned ends pass through write_chunk. Delta-coded records are encoded
+// into write_chunk and programmed chunk by chunk. With n = 0 data is a
+// marker, programmed as is.
+static int flash_write_batch(const void *data, uint32_t n, uint32_t size)
+{
+    if (!flash_area_data) {
+        return -ENODEV;
+    }
+
+    batch_header_t hdr = {
+        .count = (uint16_t)n,
+        .page_tag = (uint16_t)head_page_seq,
+        .size = (uint16_t)size,
+        .reserved = 0xFFFF,
+    };
+    batch_writer_t bw = {
+        .offset = head_page * page_size + head_offset,
+        .fill = sizeof(hdr),
+        .data_left = sizeof(hdr) + size,
+        .commit_crc = head_page_seq,
+        .page_crc = head_crc,
+    };
+    memcpy(write_chunk, &hdr, sizeof(hdr));
+    int err;
+
+#ifndef DATA_FLASH_MMAP_BASE
+    // A cached image of the head page no longer shows all of its batches
+    if (read_buf_page == head_page) {
+        read_buf_page = PAGE_NONE;
+    }
+#endif
+
+    if (!head_delta || n == 0) {
+        const uint8_t *payload = data;
+
+        // Complete the write block holding the header, then program whole
+        // blocks from the ring
+        uint32_t lead = MIN(ROUND_UP(bw.fill, write_align) - bw.fill, size);
+        memcpy(write_chunk + bw.fill, payload, lead);
+        bw.fill += lead;
+        uint32_t direct = ROUND_DOWN(size - lead, write_align);
+        if (direct > 0) {
+            err = batch_program_chunk(&bw, bw.fill);
+            if (!err) {
+                err = batch_program(&bw, payload + lead, direct);
+            }
+            if (err) {
+                return err;
+            }
+        }
+        memcpy(write_chunk + bw.fill, payload + lead + direct, size - lead - direct);
+        bw.fill += size - lead - direct;
+    } else {
+        const sensor_record_t *records = data;
+        codec_writer_t w = {
+            .buf = write_chunk,
+            .size_bits = sizeof(write_chunk) * 8,
+            .pos = bw.fill * 8,
+        };
+        for (uint32_t i = 0; i < n; i++) {
+            const sensor_record_t *prev = (i > 0) ? &records[i - 1] :
+                                          (head_records > 0) ? &head_last : NULL;
+            // Fits: write_chunk holds one more record past a full chunk
+            (void)record_codec_encode(&w, prev, &records[i]);
+            if (w.pos >= WRITE_CHUNK_SIZE * 8) {
+                bw.fill = DIV_ROUND_UP(w.pos, 8);
+                err = batch_program_chunk(&bw, WRITE_CHUNK_SIZE);
+                if (err) {
+                    return err;
+                }
+                w.pos -= WRITE_CHUNK_SIZE * 8;
+            }
+        }
+
+        // Pad the last byte with 1s (erased state)
+        bw.fill = DIV_ROUND_UP(w.pos, 8);
+        if (w.pos & 7) {
+            write_chunk[bw.fill - 1] |= 0xFF >> (w.pos & 7);
+        }
+    }
+
+    uint32_t end = ROUND_UP(bw.fill, write_align);
+    if (end > 0) {
+        memset(write_chunk + bw.fill, 0xFF, end - bw.fill);
+        bw.fill = end;
+        err = batch_program_chunk(&bw, end);
+        if (err) {
+            return err;
+        }
+    }
+
+    batch_commit_t commit = {
+        .crc = bw.commit_crc,
+    };
+    memset(write_chunk, 0xFF, commit_size());
+    memcpy(write_chunk, &commit, sizeof(commit));
+    err = batch_program(&bw, write_chunk, commit_size());
+    if (err) {
+        return err;
+    }
+
+    head_crc = bw.page_crc;
+    return 0;
+}
+
+// Append a marker batch to the head page. Clears marker_next once it is
+// on flash.
+static int flash_write_marker(const storage_marker_t *marker)
+{
+    int err = flash_write_batch(marker, 0, sizeof(*marker));
+    if (err) {
+        return err;
+    }
+    head_offset += batch_span(sizeof(*marker));
+
+    k_spinlock_key_t key = k_spin_lock(&marker_lock);
+    marker_last = *marker;
+    if (memcmp(&marker_next, marker, sizeof(*marker)) == 0) {
+        marker_next.interval_s = 0;
+    }
+    k_spin_unlock(&marker_lock, key);
+    return 0;
+}
+
+// Producer: the sample just taken is not stored. Downsampling skips are
+// regular and covered by the interval of the marker in force (interval_s);
+// any other skip (interval_s 0) leaves the following records off that
+// interval, so the next staged record needs a marker. A marker still waiting
+// for the storage thread would hold that one back: the thread is woken to
+// write it first.
+static void marker_skip(uint32_t interval_s)
+{
+    k_spinlock_key_t key = k_spin_lock(&marker_lock);
+    bool due = (interval_s != marker_interval_s);
+    marker_due |= due;
+    bool wake = due && marker_next.interval_s != 0;
+    k_spin_unlock(&marker_lock, key);
+
+    if (wake) {
+        k_sem_give(&flush_sem);
+    }
+}
+
+// Producer: anchor a marker on the record just staged at seq if one is due,
+// or if records are now interval_s apart instead of the interval of the last
+// one. One marker is in flight at a time; a due one waits for a later record.
+static void marker_anchor(uint32_t seq, uint32_t interval_s)
+{
+    k_spinlock_key_t key = k_spin_lock(&marker_lock);
+    marker_due |= (interval_s != marker_interval_s);
+    if (marker_next.interval_s == 0 &&
+        (marker_due || seq - marker_anchor_seq >= STORAGE_MARKER_RECORDS)) {
+        uint32_t now_s = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+        storage_marker_t marker = {
+            .seq = seq,
+            .boot_count = boot_count,
+            .uptime_s = now_s,
+            .epoch_s = epoch_base_s ? epoch_base_s + (now_s - epoch_base_uptime_s) : 0,
+            .interval_s = interval_s,
+            .reserved = 0xFFFF,
+        };
+        marker_next = marker;
+        marker_due = false;
+        marker_anchor_seq = seq;
+        marker_interval_s = interval_s;
+
+        retained.marker = marker;
+        retained.marker_crc = crc32_ieee((const uint8_t *)&marker, sizeof(marker));
+    }
+    k_spin_unlock(&marker_lock, key);
+}
+
+// Check the batch at offset of a page image; false at the end of the
+// committed batches
+static bool batch_header_at(const uint8_t *image, uint32_t offset, batch_header_t *hdr)
+{
+    const page_header_t *page = (const page_header_t *)image;
+
+    if (offset + sizeof(*hdr) > page_size) {
+        return false;
+    }
+    memcpy(hdr, &image[offset], sizeof(*hdr));
+    if (hdr->count == 0xFFFF || hdr->page_tag != (uint16_t)page->page_seq ||
+        offset + batch_span(hdr->size) > page_size) {
+        return false;
+    }
+    if (hdr->count == 0 ? hdr->size != sizeof(storage_marker_t) :
+        page->magic == PAGE_MAGIC_RAW && hdr->size != hdr->count * sizeof(sensor_record_t)) {
+        return false;
+    }
+
+    batch_commit_t commit;
+    uint32_t used = sizeof(*hdr) + hdr->size;
+    memcpy(&commit, &image[offset + ROUND_UP(used, write_align)], sizeof(commit));
+    return commit.crc == crc32_ieee_update(page->page_seq, &image[offset], used);
+}
+
+// Decode n records of the delta batch at offset, starting at bit position *bit.
+// *prev is the record before them; keyframe is set when the first one is the
+// first record of the page. Records are stored in out when given.
+static int delta_decode(const uint8_t *image, uint32_t offset, const batch_header_t *hdr,
+                        uint32_t *bit, sensor_record_t *prev, bool keyframe, uint32_t n,
+                        sensor_record_t *out)
+{
+    codec_reader_t r = {
+        .buf = &image[offset + sizeof(batch_header_t)],
+        .size_bits = hdr->size * 8U,
+        .pos = *bit,
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        sensor_record_t record;
+        int err = record_codec_decode(&r, (keyframe && i == 0) ? NULL : prev, &record);
+        if (err) {
+            return err;
+        }
+        *prev = record;
+        if (out) {
+            out[i] = record;
+        }
+    }
+
+    *bit = r.pos;
+    return 0;
+}
+
+// Check word of the record staged at seq
+static uint32_t staged_check(uint32_t seq)
+{
+    return crc32_ieee_update(seq, (const uint8_t *)&stage_ring[seq % STAGE_RING_SIZE],
+                             sizeof(sensor_record_t));
+}
+
+// Producer: cover the record just staged at seq. One record's CRC, however
+// far the storage thread has committed meanwhile.
+static void retain_staged(uint32_t seq)
+{
+    stage_check[seq % STAGE_RING_SIZE] = staged_check(seq);
+
+    // A reset between the two stores leaves a checked record at head;
+    // restore_staged() takes it too
+    barrier_dmem_fence_full();
+    retained.head = seq + 1;
+}
+
+// Take back the staged records that survived a warm reset in retained RAM.
+// Runs after recover_log(): ring_tail is the end of the log on flash.
+static void restore_staged(void)
+{
+    uint32_t tail = (uint32_t)atomic_get(&ring_tail);
+    uint32_t head = tail;
+
+    if (retained.magic == RETAINED_MAGIC && retained.ring_size == STAGE_RING_SIZE &&
+        tail <= retained.head && retained.head - tail <= STAGE_RING_SIZE) {
+        // Up to head as stored, or one further if the reset fell between the
+        // check word and head. A slot of an earlier lap fails its check
+        // word, which is seeded with the seq.
+        uint32_t end = MIN(retained.head + 1, tail + STAGE_RING_SIZE);
+        while (head < end && stage_check[head % STAGE_RING_SIZE] == staged_check(head)) {
+            head++;
+        }
+    }
+
+    if (head > tail) {
+        LOG_WRN("Recovered %u staged records from retained RAM", head - tail);
+        atomic_set(&ring_head, head);
+        age_mark_seq = tail;
+        age_mark_ms = k_uptime_get_32();
+
+        // Their marker, if it was not on flash yet
+        storage_marker_t marker = retained.marker;
+        if (marker.interval_s != 0 && marker.seq >= tail && marker.seq < head &&
+            crc32_ieee((const uint8_t *)&marker, sizeof(marker)) == retained.marker_crc) {
+            marker_next = marker;
+        }
+    }
+
+    retained.magic = RETAINED_MAGIC;
+    retained.ring_size = STAGE_RING_SIZE;
+    retained.head = head;
+    retained.marker = marker_next;
+    retained.marker_crc = crc32_ieee((const uint8_t *)&marker_next, sizeof(marker_next));
+}
+
+static int save_state(void)
+{
+    // Repeated acknowledgements of the same position cost no write
+    if (last_sent_seq == saved_last_sent) {
+        return 0;
+    }
+
+    meta_state_t state = {
+        .last_sent_seq = last_sent_seq,
+        .version = META_STATE_VERSION,
+    };
+    ssize_t len = meta_write(&meta_fs, META_KEY_STATE, &state, sizeof(state));
+    if (len < 0) {
+        return (int)len;
+    }
+    saved_last_sent = last_sent_seq;
+    return 0;
+}
+
+static int load_state(void)
+{
+    meta_state_t state;
+
+    last_sent_seq = 0;
+    if (meta_read(&meta_fs, META_KEY_STATE, &state, sizeof(state)) == sizeof(state) &&
+        state.version == META_STATE_VERSION) {
+        last_sent_seq = state.last_sent_seq;
+    } else if (meta_read(&meta_fs, META_KEY_LAST_SENT, &last_sent_seq,
+                         sizeof(last_sent_seq)) != sizeof(last_sent_seq)) {
+        last_sent_seq = 0;
+    }
+    saved_last_sent = last_sent_seq;
+
+    return 0;
+}
+
+// Get a page image to parse batches from; reload forces a fresh copy of a
+// page that may have been appended to since it was read
+static int load_page_image(uint32_t page, bool reload, const uint8_t **image)
+{
+#ifdef DATA_FLASH_MMAP_BASE
+    ARG_UNUSED(reload);
+    *image = (const uint8_t *)(DATA_FLASH_MMAP_BASE + flash_area_data->fa_off +
+                               page * page_size);
+    return 0;
+#else
+    if (reload || read_buf_page != page) {
+        read_buf_page = PAGE_NONE;
+        int err = flash_area_read(flash_area_data, page * page_size,
+                                  read_buf, page_size);
+        if (err) {
+            return err;
+        }
+        read_buf_page = page;
+    }
+    *image = read_buf;
+    return 0;
+#endif
+}
+
+// Parse the batches of the head page image to find the append position,
+// record count, last record, zone map and last marker after a reset
+static void scan_head_page(const uint8_t *image)
+{
+    batch_header_t hdr;
+
+    head_offset = data_offset;
+    head_records = 0;
+    head_crc = head_page_seq;
+    head_delta = (((const page_header_t *)image)->magic == PAGE_MAGIC_DELTA);
+
+    while (batch_header_at(image, head_offset, &hdr)) {
+        if (hdr.count == 0) {
+            memcpy(&marker_last, &image[head_offset + sizeof(hdr)], sizeof(marker_last));
+        }
+
+        uint32_t bit = 0;
+        uint32_t i;
+        for (i = 0; i < hdr.count; i++) {
+            sensor_record_t record;
+            if (head_delta) {
+                if (delta_decode(image, head_offset, &hdr, &bit, &head_last,
+                                 head_records + i == 0, 1, &record) != 0) {
+                    break;
+                }
+            } else {
+                memcpy(&record, &image[head_offset + sizeof(hdr) + i * sizeof(record)],
+                       sizeof(record));
+            }
+            zone_add(&head_zone, head_records + i == 0, &record);
+        }
+        if (i < hdr.count) {
+            break;
+        }
+
+        uint32_t size = batch_span(hdr.size);
+        head_crc = crc32_ieee_update(head_crc, &image[head_offset], size);
+        head_records += hdr.count;
+        head_offset += size;
+    }
+
+    // Anything programmed after the last committed batch is a batch torn by
+    // a reset. Flash needs an erase before it can be programmed again, so the
+    // rest of the page is given up and the next flush opens a new page. RRAM
+    // simply overwrites it.
+    if (erase_needed) {
+        for (uint32_t i = head_offset; i < page_size; i++) {
+            if (image[i] != 0xFF) {
+                LOG_WRN("Discarding torn batch at page %u offset %u", head_page, head_offset);
+                head_offset = page_size;
+                break;
+            }
+        }
+    }
+}
+
+// Rebuild log state from page headers. Pages are opened in ring order with
+// increasing page_seq, so the head is the last page whose page_seq is not
+// below that of page 0; a binary search finds it in O(log pages) reads.
+// A reset while a page is being erased or its header programmed leaves that
+// one page (the one after the head) without a valid header.
+static int recover_log(void)
+{
+    page_header_t first_hdr;
+    page_header_t hdr;
+    uint32_t first_page = 0;
+
+    for (uint32_t i = 0; i < page_count; i++) {
+        page_first_seq[i] = PAGE_NONE;
+    }
+
+    if (read_page_header(0, &first_hdr) != 0) {
+        // Page 0 torn while being reopened after a wrap: page 1 starts the ring
+        if (page_count < 2 || read_page_header(1, &first_hdr) != 0) {
+            LOG_INF("No log found, starting empty");
+            return 0;
+        }
+        first_page = 1;
+    }
+
+    uint32_t lo = first_page;
+    uint32_t hi = page_count - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (read_page_header(mid, &hdr) == 0 && hdr.page_seq >= first_hdr.page_seq) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    page_header_t head_hdr;
+    int err = read_page_header(lo, &head_hdr);
+    if (err) {
+        return err;
+    }
+    head_page = lo;
+    head_page_seq = head_hdr.page_seq;
+    page_first_seq[head_page] = head_hdr.first_seq;
+
+    // The page after the head is the tail once the ring has been filled, or
+    // the one after that if the reset hit while the tail was being reopened.
+    // Otherwise the ring starts at the first valid page (in a two-page ring
+    // that may be the head itself).
+    tail_page = first_page;
+    for (uint32_t step = 1; step <= 2; step++) {
+        uint32_t next = (head_page + step) % page_count;
+        if (next != head_page && read_page_header(next, &hdr) == 0 &&
+            hdr.page_seq < head_page_seq) {
+            tail_page = next;
+            break;
+        }
+    }
+    err = get_page_first_seq(tail_page, &oldest_seq);
+    if (err) {
+        return err;
+    }
+    wrapped = (oldest_seq > 0);
+
+    const uint8_t *image;
+    err = load_page_image(head_page, true, &image);
+    if (err) {
+        return err;
+    }
+    scan_head_page(image);
+    atomic_set(&ring_tail, head_hdr.first_seq + head_records);
+    atomic_set(&ring_head, head_hdr.first_seq + head_records);
+
+    // A reset right after the head page was opened leaves it without the
+    // copy of the last marker; that one ends the page before
+    if (marker_last.interval_s == 0 && head_page != tail_page) {
+        uint32_t page = (head_page + page_count - 1) % page_count;
+        uint32_t offset = data_offset;
+        batch_header_t batch;
+        err = load_page_image(page, true, &image);
+        if (err) {
+            return err;
+        }
+        while (batch_header_at(image, offset, &batch)) {
+            if (batch.count == 0) {
+                memcpy(&marker_last, &image[offset + sizeof(batch)], sizeof(marker_last));
+            }
+            offset += batch_span(batch.size);
+        }
+    }
+
+    LOG_INF("Log recovered: pages %u..%u, records %u..%u",
+            tail_page, head_page, oldest_seq, (uint32_t)atomic_get(&ring_tail));
+    return 0;
+}
+
+// Locate the page holding a flashed record: binary search over the ring
+// from tail to head, page first indices are increasing in that order
+static int find_page(uint32_t seq, uint32_t *page)
+{
+    uint32_t lo = 0;
+    uint32_t hi = page_count_in_log() - 1;
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        uint32_t first;
+        int err = get_page_first_seq((tail_page + mid) % page_count, &first);
+        if (err) {
+            return err;
+        }
+        if (first <= seq) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    *page = (tail_page + lo) % page_count;
+    return 0;
+}
+
+// Recompute the backpressure status after the log or the acknowledged
+// position changed. Called with log_mutex held.
+static void update_backpressure(void)
+{
+    // Pages from the one holding the first unacknowledged record to the head
+    uint32_t unacked_pages = 0;
+    if (head_page != PAGE_NONE && last_sent_seq < (uint32_t)atomic_get(&ring_tail)) {
+        uint32_t page = tail_page;
+        if (last_sent_seq > oldest_seq && find_page(last_sent_seq, &page) != 0) {
+            page = tail_page;
+        }
+        unacked_pages = (head_page + page_count - page) % page_count + 1;
+    }
+
+    storage_backpressure_t state = STORAGE_BACKPRESSURE_NONE;
+    if (unacked_pages == page_count) {
+        state = STORAGE_BACKPRESSURE_FULL;
+    } else if (atomic_get(&retention) == STORAGE_RETENTION_DOWNSAMPLE &&
+               unacked_pages * 100 >= page_count * STORAGE_DOWNSAMPLE_FILL_PCT) {
+        state = STORAGE_BACKPRESSURE_DOWNSAMPLE;
+    }
+
+    if (atomic_set(&backpressure, state) != state) {
+        if (state == STORAGE_BACKPRESSURE_NONE) {
+            LOG_INF("Backpressure cleared");
+        } else {
+            LOG_WRN("Backpressure %d: %u of %u pages hold unacknowledged records",
+                    state, unacked_pages, page_count);
+        }
+    }
+}
+
+// Records of the tail page the gateway has not acknowledged
+static uint32_t tail_unacked_records(void)
+{
+    uint32_t end;
+    if (get_page_first_seq((tail_page + 1) % page_count, &end) != 0) {
+        end = (uint32_t)atomic_get(&ring_tail);
+    }
+    return (last_sent_seq < end) ? end - MAX(last_sent_seq, oldest_seq) : 0;
+}
+
+// Commit staged records [ring_tail, head) to the log. Runs on the storage
+// thread with log_mutex held.
+static int flush_staged(uint32_t head)
+{
+    uint32_t tail = (uint32_t)atomic_get(&ring_tail);
+    uint32_t records_written = 0;
+
+    // Append records to the open page, opening (and erasing) a new page only
+    // when the current one cannot hold another batch
+    while (tail < head) {
+        k_spinlock_key_t key = k_spin_lock(&marker_lock);
+        storage_marker_t marker = marker_next;
+        k_spin_unlock(&marker_lock, key);
+
+        // Batches take contiguous records, so stop at the end of the ring,
+        // and at a marker, which goes right before its record
+        uint32_t slot = tail % STAGE_RING_SIZE;
+        uint32_t available = MIN(head - tail, STAGE_RING_SIZE - slot);
+        bool marker_now = (marker.interval_s != 0 && marker.seq <= tail);
+        if (marker.interval_s != 0 && marker.seq > tail) {
+            available = MIN(available, marker.seq - tail);
+        }
+        uint32_t size = 0;
+        uint32_t records_in_chunk = 0;
+        if (head_page != PAGE_NONE) {
+            if (marker_now) {
+                if (batch_span(sizeof(marker)) <= page_size - head_offset) {
+                    int err = flash_write_marker(&marker);
+                    if (err) {
+                        LOG_ERR("Flash marker write failed: %d", err);
+                        return err;
+                    }
+                    continue;
+                }
+            } else {
+                records_in_chunk = plan_batch(&stage_ring[slot], available,
+                                              page_size - head_offset, &size);
+            }
+        }
+
+        if (records_in_chunk == 0) {
+            uint32_t next_page = 0;
+            int err;
+
+            if (head_page != PAGE_NONE) {
+                next_page = (head_page + 1) % page_count;
+
+                // Reusing the tail page drops its records; unacknowledged
+                // ones only in drop-oldest retention
+                if (next_page == tail_page) {
+                    uint32_t unacked = tail_unacked_records();
+                    if (unacked > 0) {
+                        if (atomic_get(&retention) != STORAGE_RETENTION_DROP_OLDEST) {
+                            update_backpressure();
+                            return -ENOSPC;
+                        }
+                        atomic_add(&stat_unacked_lost, unacked);
+                    }
+                }
+
+                err = flash_seal_page();
+                if (err) {
+                    LOG_ERR("Flash page seal failed: %d", err);
+                    return err;
+                }
+            }
+
+            err = flash_open_page(next_page);
+            if (err) {
+                LOG_ERR("Flash page open failed: %d", err);
+                return err;
+            }
+
+            // Every page starts with the marker in force
+            if (marker_last.interval_s != 0) {
+                err = flash_write_marker(&marker_last);
+                if (err) {
+                    LOG_ERR("Flash marker write failed: %d", err);
+                    return err;
+                }
+            }
+            if (wrapped && next_page == 0) {
+                LOG_WRN("Storage wrapped, reusing oldest page");
+            }
+            continue;
+        }
 
-// Storage state
-static uint32_t current_index = 0;
-static uint32_t last_sent_index = 0;
-static bool wrapped = false;
-static bool initialized = false;
+        int err = flash_write_batch(&stage_ring[slot], records_in_chunk, size);
+        if (err) {
+            LOG_ERR("Flash write failed: %d", err);
+            return err;
+        }
 
-// NVS instance
-static struct nvs_fs nvs_fs;
+        for (uint32_t i = 0; i < records_in_chunk; i++) {
+            zone_add(&head_zone, head_records + i == 0, &stage_ring[slot + i]);
+        }
+        head_offset += batch_span(size);
+        head_records += records_in_chunk;
+        head_last = stage_ring[slot + records_in_chunk - 1];
+        tail += records_in_chunk;
+        records_written += records_in_chunk;
 
-static int flash_write_page(uint32_t page_offset, const void *data, size_t len)
-{
-    if (!flash_area_data) {
-        return -ENODEV;
+        // Committed: the producer may now reuse these slots
+        atomic_set(&ring_tail, tail);
     }
 
-    // Erase page if needed (simplified - assumes we track erased pages)
-    // For ring buffer, we'll erase entire partition on init
-    int err = flash_area_erase(flash_area_data, page_offset, FLASH_PAGE_SIZE);
-    if (err) {
-        return err;
+    if (records_written > 0) {
+        atomic_inc(&stat_flushes);
     }
+    update_backpressure();
+    LOG_INF("Flushed %u records to flash, total seq: %u (flushes %u, programmed %u bytes)",
+            records_written, tail, (uint32_t)atomic_get(&stat_flushes),
+            (uint32_t)atomic_get(&stat_bytes));
 
-    // Ensure write length is word-aligned; pad with 0xFF if needed
-    uint32_t padded_len = (len + 3U) & ~3U; // round up to 4 bytes
-    static uint8_t write_buf[FLASH_PAGE_SIZE];
-    if (padded_len > FLASH_PAGE_SIZE) {
-        return -EINVAL;
-    }
-    memcpy(write_buf, data, len);
-    if (padded_len > len) {
-        memset(write_buf + len, 0xFF, padded_len - len);
-    }
+    return 0;
+}
 
-    err = flash_area_write(flash_area_data, page_offset, write_buf, padded_len);
-    return err;
+static void storage_thread_fn(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    while (true) {
+        k_sem_take(&flush_sem, K_FOREVER);
+
+        // On error the records stay staged and are retried on the next flush
+        // request; storage_write() keeps filling the rest of the ring
+        k_mutex_lock(&log_mutex, K_FOREVER);
+        int err = flush_staged((uint32_t)atomic_get(&ring_head));
+        k_mutex_unlock(&log_mutex);
+
+        // Closed rollup periods go to their own partition
+        (void)rollup_commit();
+
+        atomic_set(&flush_err, err);
+        k_event_post(&storage_events, STORAGE_EVENT_FLUSHED);
+    }
 }
 
-static int save_state_to_nvs(void)
+K_THREAD_DEFINE(storage_thread, STORAGE_THREAD_STACK_SIZE, storage_thread_fn, NULL, NULL, NULL,
+                STORAGE_THREAD_PRIORITY, 0, 0);
+
+// Read page layout and size of the data partition and check the log fits it,
+// so a partition change in pm.yml never makes the log write past its end
+static int init_geometry(void)
 {
-    int err;
-    
-    err = nvs_write(&nvs_fs, NVS_KEY_LAST_INDEX, &current_index, sizeof(current_index));
+    const struct device *dev = flash_area_get_device(flash_area_data);
+    struct flash_pages_info info;
+
+    int err = flash_get_page_info_by_offs(dev, flash_area_data->fa_off, &info);
     if (err) {
+        LOG_ERR("Failed to get page info for data partition: %d", err);
         return err;
     }
-    
-    err = nvs_write(&nvs_fs, NVS_KEY_LAST_SENT, &last_sent_index, sizeof(last_sent_index));
-    if (err) {
-        return err;
+    page_size = info.size;
+    if (page_size == 0 || page_size > STORAGE_MAX_PAGE_SIZE) {
+        LOG_ERR("Flash page size %u not supported (max %u)",
+                page_size, STORAGE_MAX_PAGE_SIZE);
+        return -ENOTSUP;
+    }
+    if (info.start_offset != flash_area_data->fa_off) {
+        LOG_ERR("Data partition does not start on a page boundary");
+        return -EINVAL;
     }
-    
-    uint8_t wrapped_byte = wrapped ? 1 : 0;
-    err = nvs_write(&nvs_fs, NVS_KEY_WRAPPED, &wrapped_byte, sizeof(wrapped_byte));
-    
-    return err;
-}
 
-static int load_state_from_nvs(void)
-{
-    int err;
-    size_t len;
-    
-    len = sizeof(current_index);
-    err = nvs_read(&nvs_fs, NVS_KEY_LAST_INDEX, &current_index, len);
-    if (err < 0) {
-        current_index = 0;
-    }
-    
-    len = sizeof(last_sent_index);
-    err = nvs_read(&nvs_fs, NVS_KEY_LAST_SENT, &last_sent_index, len);
-    if (err < 0) {
-        last_sent_index = 0;
-    }
-    
-    uint8_t wrapped_byte = 0;
-    len = sizeof(wrapped_byte);
-    err = nvs_read(&nvs_fs, NVS_KEY_WRAPPED, &wrapped_byte, len);
-    if (err >= 0) {
-        wrapped = (wrapped_byte != 0);
-    }
-    
-    return 0;
-}
+    page_count = flash_area_data->fa_size / page_size;
+    if (page_count < 2) {
+        LOG_ERR("Data partition too small: %u bytes, need 2 pages of %u",
+                (uint32_t)flash_area_data->fa_size, page_size);
+        return -ENOSPC;
+    }
+    if (page_count > STORAGE_MAX_PAGES) {
+        LOG_WRN("Using %u of %u data pages (STORAGE_MAX_PAGES)",
+                STORAGE_MAX_PAGES, page_count);
+        page_count = STORAGE_MAX_PAGES;
+    }
+    if (flash_area_data->fa_size % page_size) {
+        LOG_WRN("Last %u bytes of data partition unused",
+                (uint32_t)(flash_area_data->fa_size % page_size));
+    }
 
-static int flush_ram_buffer(void)
-{
-    if (ram_buffer_count == 0) {
-        return 0;
+    // Pages must be uniform: the last page of the ring must match the first
+    err = flash_get_page_info_by_offs(dev, flash_area_data->fa_off +
+                                      (page_count - 1) * page_size, &info);
+    if (err || info.size != page_size) {
+        LOG_ERR("Data partition pages are not uniform");
+        return -ENOTSUP;
     }
 
-    // Calculate how many records fit in a page
-    const uint32_t records_per_page = FLASH_PAGE_SIZE / sizeof(sensor_record_t);
-    
-    // Write records in page-sized chunks
-    uint32_t records_written = 0;
-    while (records_written < ram_buffer_count) {
-        uint32_t records_in_chunk = ram_buffer_count - records_written;
-        if (records_in_chunk > records_per_page) {
-            records_in_chunk = records_per_page;
-        }
-        
-        // Calculate page offset for current_index
-        uint32_t page_index = current_index / records_per_page;
-        uint32_t page_offset = page_index * FLASH_PAGE_SIZE;
-        
-        // Check if we need to wrap
-        if (page_offset >= DATA_PARTITION_SIZE) {
-            wrapped = true;
-            page_index = 0;
-            page_offset = 0;
-            current_index = 0;
-            LOG_WRN("Storage wrapped, resetting to beginning");
-        }
-        
-        // Write page
-        int err = flash_write_page(page_offset, 
-                                   &ram_buffer[records_written],
-                                   records_in_chunk * sizeof(sensor_record_t));
-        if (err) {
-            LOG_ERR("Flash write failed: %d", err);
-            return err;
+    // The metadata partition (also the fallback) must never be shared with the log
+    const struct flash_area *meta_area;
+    if (flash_area_open(META_PARTITION_ID, &meta_area) == 0) {
+        bool overlap = flash_area_get_device(meta_area) == dev &&
+                       meta_area->fa_off < flash_area_data->fa_off + flash_area_data->fa_size &&
+                       flash_area_data->fa_off < meta_area->fa_off + meta_area->fa_size;
+        flash_area_close(meta_area);
+        if (overlap) {
+            LOG_ERR("Data partition overlaps metadata, define sensor_storage in pm.yml");
+            return -EINVAL;
         }
-        
-        current_index += records_in_chunk;
-        records_written += records_in_chunk;
     }
-    
-    ram_buffer_count = 0;
-    last_flash_write_time = k_uptime_get();
-    
-    // Save state
-    save_state_to_nvs();
-    
-    LOG_INF("Flushed %u records to flash, total index: %u", records_written, current_index);
-    
+
+    // RRAM (nRF54L) has no explicit erase: pages are programmed in place
+    const struct flash_parameters *params = flash_get_parameters(dev);
+    erase_needed = (flash_params_get_erase_cap(params) & FLASH_ERASE_C_EXPLICIT) != 0;
+    if (erase_needed && params->erase_value != 0xFF) {
+        LOG_ERR("Erased flash reads 0x%02x, log needs 0xff", params->erase_value);
+        return -ENOTSUP;
+    }
+    write_align = MAX(flash_area_align(flash_area_data), 1U);
+    if (write_align > WRITE_CHUNK_SIZE / 4) {
+        LOG_ERR("Write block %u too large (max %u)", write_align, WRITE_CHUNK_SIZE / 4);
+        return -ENOTSUP;
+    }
+    if (page_size % write_align) {
+        LOG_ERR("Page size %u is not a multiple of write block %u",
+                page_size, write_align);
+        return -EINVAL;
+    }
+    seal_offset = ROUND_UP(sizeof(page_header_t), write_align);
+    data_offset = ROUND_UP(seal_offset + sizeof(page_seal_t), write_align);
+    if (data_offset + batch_span(sizeof(sensor_record_t)) > page_size) {
+        LOG_ERR("Page size %u too small for write block %u", page_size, write_align);
+        return -EINVAL;
+    }
+
+    LOG_INF("Data log: %u pages of %u bytes at 0x%lx, write block %u, erase %s",
+            page_count, page_size, (unsigned long)flash_area_data->fa_off,
+            write_align, erase_needed ? "required" : "skipped");
+    LOG_INF("Data log capacity: %u records raw", storage_get_max_count());
     return 0;
 }
 
@@ -185,68 +1416,120 @@ int storage_init(void)
     }
 
     int err;
-    
+
     LOG_INF("Initializing storage...");
-    
-    // Initialize NVS
-    const struct flash_area *nvs_area;
-    err = flash_area_open(NVS_PARTITION_ID, &nvs_area);
+
+#if STORAGE_META_BENCH
+    meta_bench_run(META_PARTITION_ID);
+#endif
+
+    // Mount the metadata store
+    const struct flash_area *meta_area;
+    err = flash_area_open(META_PARTITION_ID, &meta_area);
     if (err) {
-        LOG_ERR("Failed to open NVS partition: %d", err);
+        LOG_ERR("Failed to open metadata partition: %d", err);
         return err;
     }
-    
+
     // Get flash device from flash area
-    const struct device *flash_dev = flash_area_get_device(nvs_area);
+    const struct device *flash_dev = flash_area_get_device(meta_area);
     if (flash_dev == NULL) {
         LOG_ERR("Failed to get flash device");
-        flash_area_close(nvs_area);
+        flash_area_close(meta_area);
         return -ENODEV;
     }
-    
-    nvs_fs.flash_device = flash_dev;
-    nvs_fs.offset = nvs_area->fa_off;
+
+    meta_fs.flash_device = flash_dev;
+    meta_fs.offset = meta_area->fa_off;
     /* Derive sector size from flash geometry */
     struct flash_pages_info info;
-    err = flash_get_page_info_by_offs(nvs_fs.flash_device, nvs_fs.offset, &info);
+    err = flash_get_page_info_by_offs(meta_fs.flash_device, meta_fs.offset, &info);
     if (err) {
-        LOG_ERR("Failed to get page info for NVS: %d", err);
-        flash_area_close(nvs_area);
+        LOG_ERR("Failed to get page info for metadata: %d", err);
+        flash_area_close(meta_area);
         return err;
     }
-    nvs_fs.sector_size = info.size;
-    nvs_fs.sector_count = 2; /* 8 KB total */
-    
-    /* Erase NVS partition before mount to ensure clean state */
-    err = flash_area_erase(nvs_area, 0, nvs_area->fa_size);
+    meta_fs.sector_size = info.size;
+    meta_fs.sector_count = META_SECTOR_COUNT; /* 8 KB total */
+
+    /* Keep metadata across resets; erase only if it cannot be mounted */
+    err = meta_mount(&meta_fs);
     if (err) {
-        LOG_ERR("Failed to erase NVS partition: %d", err);
-        flash_area_close(nvs_area);
-        return err;
+        LOG_WRN("Metadata mount failed (%d), erasing partition", err);
+        err = flash_area_erase(meta_area, 0, meta_area->fa_size);
+        if (!err) {
+            err = meta_mount(&meta_fs);
+        }
     }
-
-    err = nvs_mount(&nvs_fs);
-    flash_area_close(nvs_area);
+    flash_area_close(meta_area);
     if (err) {
-        LOG_ERR("Failed to mount NVS after erase: %d", err);
+        LOG_ERR("Failed to mount metadata: %d", err);
         return err;
     }
-    LOG_INF("NVS erased and mounted");
-    
+    LOG_INF("Metadata mounted (%s)", IS_ENABLED(CONFIG_ZMS) ? "ZMS" : "NVS");
+
     // Load state
-    load_state_from_nvs();
-    LOG_INF("Storage state: index=%u, last_sent=%u, wrapped=%d", 
-            current_index, last_sent_index, wrapped);
-    
+    load_state();
+
     // Open data partition
     err = flash_area_open(DATA_PARTITION_ID, &flash_area_data);
     if (err) {
         LOG_ERR("Failed to open data partition: %d", err);
         return err;
     }
-    
+
+    err = init_geometry();
+    if (err) {
+        flash_area_close(flash_area_data);
+        flash_area_data = NULL;
+        return err;
+    }
+
+#if STORAGE_CODEC_BENCHMARK
+    record_codec_benchmark();
+#endif
+
+    err = recover_log();
+    if (err) {
+        LOG_ERR("Log recovery failed: %d", err);
+        return err;
+    }
+    LOG_INF("Storage state: seq=%u, last_sent=%u, wrapped=%d",
+            (uint32_t)atomic_get(&ring_tail), last_sent_seq, wrapped);
+
+    restore_staged();
+
+    // This boot follows the last one that left a marker
+    if (marker_last.interval_s != 0) {
+        boot_count = marker_last.boot_count + 1;
+    }
+    if (marker_next.interval_s != 0) {
+        boot_count = MAX(boot_count, marker_next.boot_count + 1);
+    }
+    LOG_INF("Boot %u", boot_count);
+
+    // Recovered records go to flash before this boot stages its own, so
+    // its marker does not wait behind theirs
+    k_mutex_lock(&log_mutex, K_FOREVER);
+    if ((uint32_t)atomic_get(&ring_head) > (uint32_t)atomic_get(&ring_tail)) {
+        (void)flush_staged((uint32_t)atomic_get(&ring_head));
+    }
+    update_backpressure();
+    k_mutex_unlock(&log_mutex);
+
     initialized = true;
     LOG_INF("Storage initialized successfully");
+
+    // Retried by the storage thread if that flush failed
+    if ((uint32_t)atomic_get(&ring_head) > (uint32_t)atomic_get(&ring_tail)) {
+        k_sem_give(&flush_sem);
+    }
+
+    // Rollups are optional: the raw log works without them
+    err = rollup_init();
+    if (err && err != -ENODEV) {
+        LOG_WRN("Rollups unavailable: %d", err);
+    }
     return 0;
 }
 
@@ -255,55 +1538,487 @@ int storage_write(const sensor_record_t *record)
     if (!initialized) {
         return -ENODEV;
     }
-    
-    // Add to RAM buffer
-    if (ram_buffer_count < RAM_BUFFER_SIZE) {
-        ram_buffer[ram_buffer_count++] = *record;
-    }
-    
-    // Flush if buffer is full or time interval passed
-    int64_t now = k_uptime_get();
-    bool time_to_flush = (now - last_flash_write_time) >= (FLASH_WRITE_INTERVAL_SEC * 1000);
-    
-    if (ram_buffer_count >= RAM_BUFFER_SIZE || time_to_flush) {
-        LOG_DBG("Flushing RAM buffer: count=%u, time_to_flush=%d", 
-                ram_buffer_count, time_to_flush);
-        return flush_ram_buffer();
-    }
-    
+
+    // Retention holding back new records until the gateway catches up;
+    // downsampled records are STORAGE_DOWNSAMPLE_KEEP samples apart
+    uint32_t interval_s = SENSOR_READ_INTERVAL_SEC;
+    if (atomic_get(&retention) != STORAGE_RETENTION_DROP_OLDEST) {
+        atomic_val_t state = atomic_get(&backpressure);
+        if (state == STORAGE_BACKPRESSURE_FULL) {
+            atomic_inc(&stat_skipped);
+            marker_skip(0);
+            return -ENOSPC;
+        }
+        if (state == STORAGE_BACKPRESSURE_DOWNSAMPLE) {
+            interval_s *= STORAGE_DOWNSAMPLE_KEEP;
+            if ((downsample_count++ % STORAGE_DOWNSAMPLE_KEEP) != 0) {
+                atomic_inc(&stat_skipped);
+                marker_skip(interval_s);
+                return 0;
+            }
+        }
+    }
+
+    // Single producer: only this function advances ring_head
+    uint32_t head = (uint32_t)atomic_get(&ring_head);
+    uint32_t tail = (uint32_t)atomic_get(&ring_tail);
+    uint32_t staged = head - tail;
+
+    // Ring full of records the storage thread has not committed yet
+    if (staged >= STAGE_RING_SIZE) {
+        k_sem_give(&flush_sem);
+        atomic_inc(&stat_dropped);
+        marker_skip(0);
+        LOG_WRN("Staging ring full, record dropped");
+        return -ENOBUFS;
+    }
+
+    stage_ring[head % STAGE_RING_SIZE] = *record;
+    retain_staged(head);
+    marker_anchor(head, interval_s);
+    atomic_set(&ring_head, head + 1);
+    bool rollup_due = rollup_add(head, record);
+
+    // Once the tracked record is committed, track the age of this one; older
+    // records staged in between are at most one flush older than it
+    uint32_t now = k_uptime_get_32();
+    if (staged == 0 || tail > age_mark_seq) {
+        age_mark_seq = head;
+        age_mark_ms = now;
+    }
+
+    storage_flush_state_t state = {
+        .staged = staged + 1,
+        .capacity = STAGE_RING_SIZE,
+        .oldest_age_ms = now - age_mark_ms,
+        .battery_v_x10 = record->battery_v_x10,
+        .transfer_active = atomic_get(&transfer_active) != 0,
+    };
+    if (flush_policy(&state) || rollup_due) {
+        k_sem_give(&flush_sem);
+    }
+
     return 0;
 }
 
-int storage_read(uint32_t index, sensor_record_t *record)
+int storage_flush(k_timeout_t timeout)
+{
+    if (!initialized) {
+        return -ENODEV;
+    }
+
+    uint32_t target = (uint32_t)atomic_get(&ring_head);
+
+    while (true) {
+        k_event_clear(&storage_events, STORAGE_EVENT_FLUSHED);
+        if ((uint32_t)atomic_get(&ring_tail) >= target) {
+            return 0;
+        }
+
+        k_sem_give(&flush_sem);
+        if (k_event_wait(&storage_events, STORAGE_EVENT_FLUSHED, false, timeout) == 0) {
+            return -EAGAIN;
+        }
+
+        int err = (int)atomic_get(&flush_err);
+        if (err) {
+            return err;
+        }
+    }
+}
+
+int storage_read(uint32_t seq, sensor_record_t *record)
 {
     if (!initialized || !record) {
         return -EINVAL;
     }
 
-    /* Read from RAM buffer if index is within buffered (not yet flushed) range */
-    if (index >= current_index && index < (current_index + ram_buffer_count)) {
-        uint32_t buffer_index = index - current_index;
-        if (buffer_index < ram_buffer_count) {
-            *record = ram_buffer[buffer_index];
+    storage_cursor_t cursor;
+    const sensor_record_t *span;
+    uint32_t count;
+
+    storage_cursor_open(&cursor, seq);
+    int err = storage_cursor_next_batch(&cursor, &span, 1, &count);
+    if (err == -EOVERFLOW) {
+        /* Already overwritten */
+        return -EINVAL;
+    }
+    if (err) {
+        return err;
+    }
+    if (count == 0) {
+        /* Not yet written */
+        return -EINVAL;
+    }
+
+    *record = *span;
+    return 0;
+}
+
+int storage_cursor_open(storage_cursor_t *cursor, uint32_t seq)
+{
+    if (!initialized || !cursor) {
+        return -EINVAL;
+    }
+
+    cursor->next_seq = seq;
+    cursor->page = STORAGE_CURSOR_NO_PAGE;
+    cursor->page_seq = 0;
+    cursor->batch_offset = 0;
+    cursor->batch_seq = 0;
+    cursor->decode_seq = 0;
+    cursor->decode_bit = 0;
+    memset(&cursor->marker, 0, sizeof(cursor->marker));
+    return 0;
+}
+
+// Position a cursor at the first batch of a page and pin it to the page's
+// current contents (page_seq)
+static int cursor_enter_page(storage_cursor_t *cursor, uint32_t page)
+{
+    page_header_t hdr;
+    int err = read_page_header(page, &hdr);
+    if (err) {
+        return err;
+    }
+
+    cursor->page = page;
+    cursor->page_seq = hdr.page_seq;
+    cursor->batch_offset = data_offset;
+    cursor->batch_seq = hdr.first_seq;
+    cursor->decode_seq = hdr.first_seq;
+    cursor->decode_bit = 0;
+    return 0;
+}
+
+// Flashed part of storage_cursor_next_batch(), called with log_mutex held
+static int cursor_read_flash(storage_cursor_t *cursor, const sensor_record_t **records,
+                             uint32_t max_count, uint32_t *count)
+{
+    uint32_t seq = cursor->next_seq;
+
+    /* The writer reused the pages holding the next records: skip to the oldest one */
+    if (seq < oldest_seq) {
+        LOG_WRN("Cursor overtaken by writer, records %u..%u lost", seq, oldest_seq - 1);
+        cursor->next_seq = oldest_seq;
+        cursor->page = STORAGE_CURSOR_NO_PAGE;
+        return -EOVERFLOW;
+    }
+
+    if (seq < cursor->decode_seq) {
+        cursor->page = STORAGE_CURSOR_NO_PAGE;
+    }
+
+    bool reloaded = false;
+    while (true) {
+        /* (Re)position on the page holding the record */
+        if (cursor->page == STORAGE_CURSOR_NO_PAGE) {
+            uint32_t page;
+            int err = find_page(seq, &page);
+            if (err) {
+                return err;
+            }
+            if (!seek_cache_restore(cursor, page, seq)) {
+                err = cursor_enter_page(cursor, page);
+                if (err) {
+                    return err;
+                }
+            }
+        }
+
+        const uint8_t *image;
+        int err = load_page_image(cursor->page, reloaded, &image);
+        if (err) {
+            return err;
+        }
+
+        /* The page was erased and reopened since the cursor entered it */
+        const page_header_t *page_hdr = (const page_header_t *)image;
+        if (page_hdr->page_seq != cursor->page_seq) {
+            seek_cache_forget(cursor->page);
+            cursor->page = STORAGE_CURSOR_NO_PAGE;
+            reloaded = false;
+            continue;
+        }
+        bool delta = (page_hdr->magic == PAGE_MAGIC_DELTA);
+        batch_header_t hdr;
+
+        while (batch_header_at(image, cursor->batch_offset, &hdr)) {
+            uint32_t batch_end = cursor->batch_seq + hdr.count;
+            uint32_t size = batch_span(hdr.size);
+
+            /* A marker applies to the records after it */
+            if (hdr.count == 0) {
+                memcpy(&cursor->marker, &image[cursor->batch_offset + sizeof(hdr)],
+                       sizeof(cursor->marker));
+                cursor->batch_offset += size;
+                continue;
+            }
+
+            /* Raw records are copied while log_mutex is held: once it is
+             * released the storage thread may erase and reuse the page */
+            if (!delta && seq < batch_end) {
+                seek_cache_save(cursor);
+                uint32_t n = MIN(MIN(max_count, batch_end - seq), STORAGE_CURSOR_BUF_SIZE);
+                memcpy(cursor->buf, &image[cursor->batch_offset + sizeof(hdr) +
+                                           (seq - cursor->batch_seq) * sizeof(sensor_record_t)],
+                       n * sizeof(sensor_record_t));
+                *records = cursor->buf;
+                *count = n;
+                cursor->next_seq += n;
+                if (cursor->next_seq == batch_end) {
+                    cursor->batch_offset += size;
+                    cursor->batch_seq = batch_end;
+                    cursor->decode_seq = batch_end;
+                }
+                return 0;
+            }
+
+            if (delta) {
+                // Decode forward from the last position up to the wanted record
+                uint32_t skip = MIN(seq, batch_end) - cursor->decode_seq;
+                err = delta_decode(image, cursor->batch_offset, &hdr, &cursor->decode_bit,
+                                   &cursor->prev, cursor->decode_seq == page_hdr->first_seq,
+                                   skip, NULL);
+                if (err) {
+                    return -EIO;
+                }
+                cursor->decode_seq += skip;
+
+                if (seq < batch_end) {
+                    seek_cache_save(cursor);
+                    uint32_t n = MIN(MIN(max_count, batch_end - seq),
+                                     STORAGE_CURSOR_BUF_SIZE);
+                    err = delta_decode(image, cursor->batch_offset, &hdr,
+                                       &cursor->decode_bit, &cursor->prev,
+                                       cursor->decode_seq == page_hdr->first_seq,
+                                       n, cursor->buf);
+                    if (err) {
+                        return -EIO;
+                    }
+                    cursor->decode_seq += n;
+                    cursor->next_seq += n;
+                    *records = cursor->buf;
+                    *count = n;
+                    if (cursor->decode_seq == batch_end) {
+                        cursor->batch_offset += size;
+                        cursor->batch_seq = batch_end;
+                        cursor->decode_bit = 0;
+                    }
+                    return 0;
+                }
+                cursor->decode_bit = 0;
+            }
+
+            cursor->batch_offset += size;
+            cursor->batch_seq = batch_end;
+            cursor->decode_seq = batch_end;
+        }
+
+        /* The head page may have grown since its image was taken */
+        if (cursor->page == head_page) {
+            if (reloaded) {
+                return -EIO;
+            }
+            reloaded = true;
+            continue;
+        }
+
+        /* Continue on the next page of the ring */
+        err = cursor_enter_page(cursor, (cursor->page + 1) % page_count);
+        if (err) {
+            return err;
+        }
+        reloaded = false;
+    }
+}
+
+int storage_cursor_next_batch(storage_cursor_t *cursor, const sensor_record_t **records,
+                              uint32_t max_count, uint32_t *count)
+{
+    if (!initialized || !cursor || !records || !count) {
+        return -EINVAL;
+    }
+
+    *count = 0;
+    uint32_t seq = cursor->next_seq;
+    if (max_count == 0) {
+        return 0;
+    }
+
+    uint32_t head = (uint32_t)atomic_get(&ring_head);
+    if (seq >= head) {
+        return 0;
+    }
+
+    /* Unflushed records are copied out of the staging ring. The producer only
+     * reuses a slot once ring_tail has passed it, so the copy is good if the
+     * records are still uncommitted afterwards; otherwise they are on flash. */
+    if (seq >= (uint32_t)atomic_get(&ring_tail)) {
+        uint32_t n = MIN(MIN(max_count, head - seq), STORAGE_CURSOR_BUF_SIZE);
+
+        /* Staged records are timed by the marker waiting for them, if it
+         * is anchored at or before seq, otherwise by the last one written */
+        k_spinlock_key_t key = k_spin_lock(&marker_lock);
+        storage_marker_t marker = marker_last;
+        if (marker_next.interval_s != 0) {
+            if (marker_next.seq <= seq) {
+                marker = marker_next;
+            } else {
+                n = MIN(n, marker_next.seq - seq);
+            }
+        }
+        k_spin_unlock(&marker_lock, key);
+
+        for (uint32_t i = 0; i < n; i++) {
+            cursor->buf[i] = stage_ring[(seq + i) % STAGE_RING_SIZE];
+        }
+        barrier_dmem_fence_full();
+        if (seq >= (uint32_t)atomic_get(&ring_tail)) {
+            *records = cursor->buf;
+            *count = n;
+            cursor->next_seq += n;
+            cursor->marker = marker;
             return 0;
-        } else {
-            return -EINVAL;
         }
     }
 
-    /* Read from flash if index < current_index */
-    if (index >= current_index) {
-        /* Not yet written to flash and not in buffer */
+    k_mutex_lock(&log_mutex, K_FOREVER);
+    int err = cursor_read_flash(cursor, records, max_count, count);
+    k_mutex_unlock(&log_mutex);
+    return err;
+}
+
+int storage_cursor_time(const storage_cursor_t *cursor, uint32_t seq, storage_time_t *time)
+{
+    if (!cursor || !time) {
         return -EINVAL;
     }
 
-    uint32_t max_count = storage_get_max_count();
-    if (index >= max_count) {
+    const storage_marker_t *marker = &cursor->marker;
+    if (marker->interval_s == 0 || seq < marker->seq) {
+        return -ENODATA;
+    }
+
+    uint32_t offset_s = (seq - marker->seq) * marker->interval_s;
+    time->boot_count = marker->boot_count;
+    time->uptime_s = marker->uptime_s + offset_s;
+    time->epoch_s = marker->epoch_s ? marker->epoch_s + offset_s : 0;
+
+    // The wall clock set later in this boot dates its earlier records too
+    k_spinlock_key_t key = k_spin_lock(&marker_lock);
+    if (time->epoch_s == 0 && epoch_base_s != 0 && marker->boot_count == boot_count) {
+        time->epoch_s = epoch_base_s - epoch_base_uptime_s + time->uptime_s;
+    }
+    k_spin_unlock(&marker_lock, key);
+    return 0;
+}
+
+void storage_set_epoch(uint32_t epoch_s)
+{
+    uint32_t now_s = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+
+    k_spinlock_key_t key = k_spin_lock(&marker_lock);
+    // A clock that agrees with the current one within a few seconds needs
+    // no new marker
+    uint32_t current = epoch_base_s ? epoch_base_s + (now_s - epoch_base_uptime_s) : 0;
+    if (current == 0 || epoch_s > current + 2 || epoch_s + 2 < current) {
+        epoch_base_s = epoch_s;
+        epoch_base_uptime_s = now_s;
+
+        // A marker of this boot still waiting for the storage thread takes
+        // the clock as well, so it dates the records staged after it now;
+        // otherwise the next record gets one
+        if (marker_next.interval_s != 0 && marker_next.boot_count == boot_count) {
+            marker_next.epoch_s = epoch_s - now_s + marker_next.uptime_s;
+            retained.marker = marker_next;
+            retained.marker_crc = crc32_ieee((const uint8_t *)&marker_next,
+                                             sizeof(marker_next));
+        } else {
+            marker_due = true;
+        }
+    }
+    k_spin_unlock(&marker_lock, key);
+}
+
+int storage_find(storage_field_t field, int32_t min, int32_t max, uint32_t *seq,
+                 sensor_record_t *record)
+{
+    if (!initialized) {
+        return -ENODEV;
+    }
+    if (field > STORAGE_FIELD_BATTERY || min > max || !seq || !record) {
         return -EINVAL;
     }
 
-    uint32_t offset = index * sizeof(sensor_record_t);
-    return flash_area_read(flash_area_data, offset, record, sizeof(sensor_record_t));
+    storage_cursor_t cursor;
+    uint32_t from = *seq;
+
+    while (true) {
+        // Flashed records are searched page by page, skipping pages whose
+        // zone map rules out a match; staged records have no zone map
+        uint32_t end;
+        bool skip = false;
+
+        k_mutex_lock(&log_mutex, K_FOREVER);
+        from = MAX(from, oldest_seq);
+        uint32_t tail = (uint32_t)atomic_get(&ring_tail);
+        if (from < tail) {
+            uint32_t page;
+            page_zone_t zone;
+            int err = find_page(from, &page);
+            if (err) {
+                k_mutex_unlock(&log_mutex);
+                return err;
+            }
+            if (page == head_page ||
+                get_page_first_seq((page + 1) % page_count, &end) != 0) {
+                end = tail;
+            }
+            skip = get_page_zone(page, &zone) && !zone_overlaps(&zone, field, min, max);
+        } else {
+            end = (uint32_t)atomic_get(&ring_head);
+        }
+        k_mutex_unlock(&log_mutex);
+
+        if (from >= end) {
+            return -ENOENT;
+        }
+        if (skip) {
+            atomic_inc(&stat_zone_skipped);
+            from = end;
+            continue;
+        }
+        if (from < tail) {
+            atomic_inc(&stat_zone_scanned);
+        }
+
+        storage_cursor_open(&cursor, from);
+        while (cursor.next_seq < end) {
+            const sensor_record_t *records;
+            uint32_t count;
+            int err = storage_cursor_next_batch(&cursor, &records, end - cursor.next_seq,
+                                                &count);
+            if (err == -EOVERFLOW) {
+                break;   // Page overwritten meanwhile: look up the tail again
+            }
+            if (err) {
+                return err;
+            }
+            if (count == 0) {
+                return -ENOENT;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                int32_t value = storage_record_field(&records[i], field);
+                if (value >= min && value <= max) {
+                    *seq = cursor.next_seq - count + i;
+                    *record = records[i];
+                    return 0;
+                }
+            }
+        }
+        from = cursor.next_seq;
+    }
 }
 
 uint32_t storage_get_count(void)
@@ -311,35 +2026,51 @@ uint32_t storage_get_count(void)
     if (!initialized) {
         return 0;
     }
-    
-    // Include records in RAM buffer
-    uint32_t total = current_index + ram_buffer_count;
-    
-    if (wrapped) {
-        return storage_get_max_count();
-    }
-    
-    return total;
+
+    // Include records in the staging buffers
+    return storage_get_next_seq() - oldest_seq;
+}
+
+uint32_t storage_get_first_seq(void)
+{
+    return oldest_seq;
+}
+
+uint32_t storage_get_next_seq(void)
+{
+    return (uint32_t)atomic_get(&ring_head);
 }
 
 uint32_t storage_get_max_count(void)
 {
-    return DATA_PARTITION_SIZE / sizeof(sensor_record_t);
+    // Raw record capacity with one batch per page; the delta codec typically
+    // stores several times more
+    return page_count *
+           ((page_size - data_offset - batch_span(0)) / sizeof(sensor_record_t));
 }
 
 uint32_t storage_get_last_sent(void)
 {
-    return last_sent_index;
+    return last_sent_seq;
 }
 
-int storage_set_last_sent(uint32_t index)
+int storage_set_last_sent(uint32_t seq)
 {
     if (!initialized) {
         return -ENODEV;
     }
-    
-    last_sent_index = index;
-    return save_state_to_nvs();
+
+    k_mutex_lock(&log_mutex, K_FOREVER);
+    last_sent_seq = MIN(seq, (uint32_t)atomic_get(&ring_head));
+    bool was_full = atomic_get(&backpressure) == STORAGE_BACKPRESSURE_FULL;
+    update_backpressure();
+    k_mutex_unlock(&log_mutex);
+
+    // Records held back by a full log may fit now
+    if (was_full) {
+        k_sem_give(&flush_sem);
+    }
+    return save_state();
 }
 
 bool storage_is_wrapped(void)
@@ -347,3 +2078,42 @@ bool storage_is_wrapped(void)
     return wrapped;
 }
 
+void storage_set_flush_policy(storage_flush_policy_t policy)
+{
+    flush_policy = policy ? policy : flush_policy_default;
+}
+
+void storage_set_retention(storage_retention_t mode)
+{
+    atomic_set(&retention, mode);
+    if (initialized) {
+        k_mutex_lock(&log_mutex, K_FOREVER);
+        update_backpressure();
+        k_mutex_unlock(&log_mutex);
+        k_sem_give(&flush_sem);
+    }
+}
+
+storage_backpressure_t storage_get_backpressure(void)
+{
+    return (storage_backpressure_t)atomic_get(&backpressure);
+}
+
+void storage_set_transfer_active(bool active)
+{
+    atomic_set(&transfer_active, active ? 1 : 0);
+}
+
+void storage_get_stats(storage_stats_t *stats)
+{
+    stats->flush_count = (uint32_t)atomic_get(&stat_flushes);
+    stats->bytes_programmed = (uint32_t)atomic_get(&stat_bytes);
+    stats->pages_erased = (uint32_t)atomic_get(&stat_erases);
+    stats->records_dropped = (uint32_t)atomic_get(&stat_dropped);
+    stats->records_skipped = (uint32_t)atomic_get(&stat_skipped);
+    stats->unacked_lost = (uint32_t)atomic_get(&stat_unacked_lost);
+    stats->zone_pages_skipped = (uint32_t)atomic_get(&stat_zone_skipped);
+    stats->zone_pages_scanned = (uint32_t)atomic_get(&stat_zone_scanned);
+    stats->seek_cache_hits = (uint32_t)atomic_get(&stat_seek_hits);
+    stats->seek_cache_misses = (uint32_t)atomic_get(&stat_seek_misses);
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <zephyr/kernel.h>
 
 // Compact sensor record format (6 bytes)
 typedef struct __attribute__((packed)) {
@@ -12,29 +13,199 @@ typedef struct __attribute__((packed)) {
     uint8_t  battery_v_x10;  // Battery in 0.1V units (0..25.5V)
 } sensor_record_t;
 
+// Time reference the log keeps between the records, which carry no
+// timestamps. Record seq >= marker.seq was taken (seq - marker.seq) *
+// interval_s seconds after the marker's uptime and epoch. A marker is
+// written at every boot, after storage_set_epoch(), after samples were
+// refused or dropped, when downsampling starts or stops (its records are
+// STORAGE_DOWNSAMPLE_KEEP intervals apart), every STORAGE_MARKER_RECORDS
+// records and at the start of every page.
+typedef struct __attribute__((packed)) {
+    uint32_t seq;            // First record the marker applies to
+    uint32_t boot_count;     // Boot that took the record, counted by the log
+    uint32_t uptime_s;       // Uptime of that boot when record seq was taken
+    uint32_t epoch_s;        // Wall-clock time of record seq (Unix seconds), 0 = not set
+    uint16_t interval_s;     // Time between records from seq on, 0 = no marker
+    uint16_t reserved;       // 0xFFFF
+} storage_marker_t;
+
+// Absolute time of a record, see storage_cursor_time()
+typedef struct {
+    uint32_t boot_count;
+    uint32_t uptime_s;
+    uint32_t epoch_s;        // 0 if the wall clock was never set in that boot
+} storage_time_t;
+
+// Maximum records returned per call, copied into the cursor's own buffer
+#define STORAGE_CURSOR_BUF_SIZE 16
+
+// Sequential reader over the log. Any number of cursors can be open at once.
+// Spans returned by storage_cursor_next_batch() point into the cursor's own
+// buffer and stay valid until the next call on the same cursor, even if the
+// writer reuses the pages they were read from in the meantime.
+typedef struct {
+    uint32_t next_seq;       // Sequence number of the next record to return
+    uint32_t page;           // Page being read, or STORAGE_CURSOR_NO_PAGE
+    uint32_t page_seq;       // page_seq of that page when the cursor entered it
+    uint32_t batch_offset;   // Offset of the current batch within the page
+    uint32_t batch_seq;      // Sequence number of the first record of the current batch
+    uint32_t decode_seq;     // Delta pages: sequence number of the next record to decode
+    uint32_t decode_bit;     // Delta pages: bit offset of that record in the batch
+    sensor_record_t prev;    // Delta pages: last decoded record
+    sensor_record_t buf[STORAGE_CURSOR_BUF_SIZE];  // Copied or decoded records
+    storage_marker_t marker; // Marker of the records last returned
+} storage_cursor_t;
+
+#define STORAGE_CURSOR_NO_PAGE UINT32_MAX
+
 // Initialize storage system
 int storage_init(void);
 
-// Write a new record (with automatic overwrite when full)
+// Write a new record (with automatic overwrite when full). Lock-free and
+// constant time: copies the record into the RAM staging ring next to its
+// CRC for warm-reset recovery; flash is written by the storage thread. Must
+// be called from a single thread. Returns -ENOBUFS if the ring is full of
+// uncommitted records (record dropped), -ENOSPC if the retention mode
+// refuses new records (see storage_retention_t). Records skipped by
+// downsampling return 0. Staged records survive a warm reset, through
+// MCUboot as well, and are committed after the next storage_init().
 int storage_write(const sensor_record_t *record);
 
-// Read a record by index
-int storage_read(uint32_t index, sensor_record_t *record);
+// Posted on storage_events each time the storage thread finishes a flush
+#define STORAGE_EVENT_FLUSHED BIT(0)
+extern struct k_event storage_events;
+
+// Commit all records written so far and wait until they are on flash.
+// Returns -EAGAIN on timeout or the flash error of the failed flush.
+int storage_flush(k_timeout_t timeout);
 
-// Get current count of records
+// Read a record by sequence number. Near-sequential reads continue from the
+// decoder position of the previous one (STORAGE_SEEK_CACHE_SLOTS) instead
+// of decoding the page from its start.
+int storage_read(uint32_t seq, sensor_record_t *record);
+
+// Position a cursor at a record sequence number
+int storage_cursor_open(storage_cursor_t *cursor, uint32_t seq);
+
+// Return the next contiguous span of up to max_count records. The records
+// are copied into cursor->buf under the log mutex, at most
+// STORAGE_CURSOR_BUF_SIZE per call, so the span stays valid until the next
+// call on the cursor. Sets *count to 0 at the end of the log. Returns -EOVERFLOW if the writer
+// overwrote the next records before they were read: the cursor has skipped
+// to the oldest stored record (cursor->next_seq) and the next call goes on
+// from there.
+int storage_cursor_next_batch(storage_cursor_t *cursor, const sensor_record_t **records,
+                              uint32_t max_count, uint32_t *count);
+
+// Time a record returned by the last storage_cursor_next_batch() call was
+// taken, from the marker the cursor passed on its way. Records of the
+// running boot get a wall-clock time once storage_set_epoch() was called,
+// even if it came after them. Returns -ENODATA for records older than the
+// first marker in the log.
+int storage_cursor_time(const storage_cursor_t *cursor, uint32_t seq, storage_time_t *time);
+
+// Set the wall-clock time (Unix seconds). Markers from the next record on
+// carry it, advanced by the uptime clock.
+void storage_set_epoch(uint32_t epoch_s);
+
+// Records are numbered with a 32-bit sequence that never wraps or resets;
+// it survives reboots and ring wrap, so a gateway can always resume at the
+// sequence number it stopped at.
+
+// Get count of records currently stored (next_seq - first_seq)
 uint32_t storage_get_count(void);
 
+// Get sequence number of the oldest record still stored
+uint32_t storage_get_first_seq(void);
+
+// Get sequence number the next written record will get
+uint32_t storage_get_next_seq(void);
+
 // Get maximum capacity
 uint32_t storage_get_max_count(void);
 
-// Get last sent index
+// Get last sent sequence number
 uint32_t storage_get_last_sent(void);
 
-// Set last sent index
-int storage_set_last_sent(uint32_t index);
+// Acknowledge that the gateway has collected all records below seq. Pages
+// holding only acknowledged records can be reused without losing data.
+int storage_set_last_sent(uint32_t seq);
 
 // Check if buffer has wrapped (overflowed)
 bool storage_is_wrapped(void);
 
+// Record fields storage_find() can search
+typedef enum {
+    STORAGE_FIELD_TEMP = 0,      // temp_x10
+    STORAGE_FIELD_PRESS = 1,     // press_kpa
+    STORAGE_FIELD_HUM = 2,       // hum_pct
+    STORAGE_FIELD_BATTERY = 3,   // battery_v_x10
+} storage_field_t;
+
+int32_t storage_record_field(const sensor_record_t *record, storage_field_t field);
+
+// Find the first record at or after *seq whose field lies in [min, max] and
+// store it and its sequence number in *record and *seq. Each page keeps the
+// range of every field (zone map), so pages that cannot match are skipped
+// without reading their records. Returns -ENOENT if no stored record matches;
+// call again from *seq + 1 for the next match.
+int storage_find(storage_field_t field, int32_t min, int32_t max, uint32_t *seq,
+                 sensor_record_t *record);
+
+// Snapshot handed to the flush policy after every storage_write()
+typedef struct {
+    uint32_t staged;         // Records in RAM not yet on flash
+    uint32_t capacity;       // Staging ring size; records are dropped when full
+    uint32_t oldest_age_ms;  // Approximate age of the oldest staged record
+    uint8_t battery_v_x10;   // Battery voltage of the newest record (0.1 V units)
+    bool transfer_active;    // A BLE transfer is reading the log
+} storage_flush_state_t;
+
+// Returns true when the staged records should be committed now
+typedef bool (*storage_flush_policy_t)(const storage_flush_state_t *state);
+
+// Replace the flush policy (NULL restores flush_policy_default)
+void storage_set_flush_policy(storage_flush_policy_t policy);
+
+// Tell the flush policy whether a BLE transfer is running
+void storage_set_transfer_active(bool active);
+
+// What the log does once records the gateway has not acknowledged fill
+// every page (storage_set_last_sent() reclaims pages)
+typedef enum {
+    STORAGE_RETENTION_DROP_OLDEST = 0,  // Reuse the oldest page anyway (plain ring)
+    STORAGE_RETENTION_DOWNSAMPLE = 1,   // Past STORAGE_DOWNSAMPLE_FILL_PCT keep one record
+                                        // in STORAGE_DOWNSAMPLE_KEEP, refuse them when full
+    STORAGE_RETENTION_STOP = 2,         // Refuse new records when full
+} storage_retention_t;
+
+// Backpressure status reported to the gateway
+typedef enum {
+    STORAGE_BACKPRESSURE_NONE = 0,
+    STORAGE_BACKPRESSURE_DOWNSAMPLE = 1, // New records are being thinned out
+    STORAGE_BACKPRESSURE_FULL = 2,       // Every page holds unacknowledged records
+} storage_backpressure_t;
+
+// Change the retention mode (default STORAGE_RETENTION from config.h)
+void storage_set_retention(storage_retention_t retention);
+
+storage_backpressure_t storage_get_backpressure(void);
+
+// Runtime counters since boot
+typedef struct {
+    uint32_t flush_count;       // Flushes that committed records
+    uint32_t bytes_programmed;  // Bytes written to the data partition
+    uint32_t pages_erased;      // Pages erased (0 on RRAM)
+    uint32_t records_dropped;   // Records lost to a full staging ring
+    uint32_t records_skipped;   // Records refused or downsampled by the retention mode
+    uint32_t unacked_lost;      // Unacknowledged records overwritten (drop-oldest)
+    uint32_t zone_pages_skipped; // Pages storage_find() ruled out by their zone map
+    uint32_t zone_pages_scanned; // Page reads by storage_find() the zone map did not avoid
+    uint32_t seek_cache_hits;   // Cursors positioned from a remembered decoder position
+    uint32_t seek_cache_misses; // Cursors that started at the beginning of their page
+} storage_stats_t;
+
+void storage_get_stats(storage_stats_t *stats);
+
 #endif // STORAGE_H
 
@@ -0,0 +1,529 @@
+#include "sim.h"
+#include "config.h"
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/nvs.h>
+#include <zephyr/sys/crc.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SIM_FLASH_FILE "sim_flash.bin"
+#define SIM_NOINIT_FILE "sim_noinit.bin"
+#define SIM_FLASH_SIZE 0x40000
+#define SIM_PAGE_SIZE 4096
+
+int sim_log_enabled;
+pthread_mutex_t sim_spin_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct device flash_dev;
+static struct flash_parameters flash_params;
+static uint32_t flash_align;
+static uint8_t *flash;
+static bool torn_writes;
+
+// Partitions in pm.yml order: nvs_storage, sensor_storage, rollup_storage
+static struct flash_area areas[] = {
+    { SIM_PARTITION_nvs_storage, 0x0, 0x2000, &flash_dev },
+    { SIM_PARTITION_sensor_storage, 0x2000, 0x1A000, &flash_dev },
+    { SIM_PARTITION_rollup_storage, 0x1C000, 0x8000, &flash_dev },
+};
+
+static int64_t uptime_ms;
+static long flash_ops;
+static long cut_after = -1;
+static bool warm_reset;
+static int failures;
+
+// ---- Test support ----
+
+void sim_configure(const sim_flash_config_t *config)
+{
+    torn_writes = config->torn;
+    flash_params.erase_value = 0xFF;
+    flash_params.write_block_size = config->rram ? 16 : 4;
+    flash_params.caps = config->rram ? 0 : FLASH_ERASE_C_EXPLICIT;
+    flash_align = flash_params.write_block_size;
+
+    uint32_t size = config->data_size ? config->data_size : 0x1A000;
+    areas[1].fa_size = size;
+    areas[2].fa_off = areas[1].fa_off + size;
+    if (areas[2].fa_off + areas[2].fa_size > SIM_FLASH_SIZE) {
+        fprintf(stderr, "sim: partitions exceed %u bytes\n", SIM_FLASH_SIZE);
+        exit(1);
+    }
+    sim_log_enabled = getenv("SIM_LOG") != NULL;
+}
+
+void sim_configure_args(int argc, char **argv)
+{
+    sim_flash_config_t config = { 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rram") == 0) {
+            config.rram = true;
+        } else if (strcmp(argv[i], "--torn") == 0) {
+            config.torn = true;
+        } else if (strncmp(argv[i], "--size=", 7) == 0) {
+            config.data_size = strtoul(argv[i] + 7, NULL, 0);
+        }
+    }
+    sim_configure(&config);
+}
+
+void sim_wipe(void)
+{
+    unlink(SIM_FLASH_FILE);
+    unlink(SIM_NOINIT_FILE);
+}
+
+void *sim_shared_alloc(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("sim: mmap");
+        exit(1);
+    }
+    return p;
+}
+
+void sim_advance(int64_t ms)
+{
+    uptime_ms += ms;
+}
+
+long sim_flash_ops(void)
+{
+    return flash_ops;
+}
+
+uintptr_t sim_flash_base(void)
+{
+    return (uintptr_t)flash;
+}
+
+sensor_record_t sim_record(uint32_t seq)
+{
+    int temp = -30 + (int)((seq / 60) % 250) + (int)((seq * 13) % 11);
+    if (seq % 20000 > 19900) {
+        temp = 300 + seq % 7;
+    }
+    sensor_record_t r = {
+        .temp_x10 = temp,
+        .press_kpa = 1000 + (seq / 500) % 5,
+        .hum_pct = 40 + (seq / 100) % 30,
+        .battery_v_x10 = 37 - (seq / 8000) % 8,
+    };
+    return r;
+}
+
+void sim_write_records(uint32_t n, uint32_t flush_every)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        sensor_record_t r = sim_record(storage_get_next_seq());
+        int err = storage_write(&r);
+        if (err == -ENOBUFS) {
+            storage_flush(K_SECONDS(1));
+            i--;
+            continue;
+        }
+        SIM_CHECK(err == 0, "write %u: %d", i, err);
+        sim_advance(SENSOR_READ_INTERVAL_SEC * MSEC_PER_SEC);
+        if (flush_every && i % flush_every == flush_every - 1) {
+            storage_flush(K_SECONDS(1));
+        }
+    }
+}
+
+void sim_fail(const char *fmt, ...)
+{
+    va_list args;
+
+    failures++;
+    if (failures > 10) {
+        return;
+    }
+    va_start(args, fmt);
+    printf("FAIL ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
+int sim_failures(void)
+{
+    return failures;
+}
+
+// ---- Retained RAM ----
+
+extern char __start_sim_noinit[], __stop_sim_noinit[];
+
+static void noinit_save(void)
+{
+    FILE *f = fopen(SIM_NOINIT_FILE, "wb");
+    fwrite(__start_sim_noinit, 1, __stop_sim_noinit - __start_sim_noinit, f);
+    fclose(f);
+}
+
+// Warm reset: the saved section. Cold boot: whatever the RAM powers up with
+static void noinit_load(void)
+{
+    FILE *f = fopen(SIM_NOINIT_FILE, "rb");
+    if (f && fread(__start_sim_noinit, 1, __stop_sim_noinit - __start_sim_noinit, f) ==
+                 (size_t)(__stop_sim_noinit - __start_sim_noinit)) {
+        fclose(f);
+        unlink(SIM_NOINIT_FILE);
+        return;
+    }
+    if (f) {
+        fclose(f);
+    }
+    for (char *p = __start_sim_noinit; p < __stop_sim_noinit; p++) {
+        *p = (char)rand();
+    }
+}
+
+// ---- Boots ----
+
+#define SIM_MAX_THREADS 4
+static sim_thread_fn_t threads[SIM_MAX_THREADS];
+static int thread_count;
+
+void sim_thread_register(sim_thread_fn_t fn)
+{
+    if (thread_count < SIM_MAX_THREADS) {
+        threads[thread_count++] = fn;
+    }
+}
+
+static void *thread_entry(void *arg)
+{
+    ((sim_thread_fn_t)arg)(NULL, NULL, NULL);
+    return NULL;
+}
+
+static void flash_map(void)
+{
+    int fd = open(SIM_FLASH_FILE, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("sim: " SIM_FLASH_FILE);
+        _exit(1);
+    }
+    bool fresh = (st.st_size != SIM_FLASH_SIZE);
+    if (fresh && ftruncate(fd, SIM_FLASH_SIZE) != 0) {
+        perror("sim: ftruncate");
+        _exit(1);
+    }
+    flash = mmap(NULL, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (flash == MAP_FAILED) {
+        perror("sim: mmap");
+        _exit(1);
+    }
+    if (fresh) {
+        memset(flash, 0xFF, SIM_FLASH_SIZE);
+    }
+}
+
+int sim_boot(int (*fn)(void *arg), void *arg, long cut, bool warm)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("sim: fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        cut_after = cut;
+        warm_reset = warm;
+        flash_map();
+        noinit_load();
+        for (int i = 0; i < thread_count; i++) {
+            pthread_t t;
+            pthread_create(&t, NULL, thread_entry, (void *)threads[i]);
+        }
+        int result = fn(arg);
+        if (warm_reset) {
+            noinit_save();
+        }
+        fflush(stdout);
+        _exit(result ? 1 : 0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status)) {
+        printf("sim: boot crashed (status 0x%x)\n", status);
+        return 1;
+    }
+    return WEXITSTATUS(status);
+}
+
+static void power_cut_now(void)
+{
+    if (warm_reset) {
+        noinit_save();
+    }
+    fflush(stdout);
+    _exit(SIM_POWER_CUT);
+}
+
+// Counts a flash operation; power goes at operation cut_after. Returns true
+// when the caller is to do part of the operation and then cut power.
+static bool flash_op(void)
+{
+    if (cut_after < 0 || flash_ops++ != cut_after) {
+        return false;
+    }
+    if (!torn_writes) {
+        power_cut_now();
+    }
+    return true;
+}
+
+// ---- Flash ----
+
+const struct flash_parameters *flash_get_parameters(const struct device *dev)
+{
+    return &flash_params;
+}
+
+int flash_get_page_info_by_offs(const struct device *dev, off_t offs,
+                                struct flash_pages_info *info)
+{
+    info->start_offset = ROUND_DOWN(offs, SIM_PAGE_SIZE);
+    info->size = SIM_PAGE_SIZE;
+    info->index = offs / SIM_PAGE_SIZE;
+    return 0;
+}
+
+int flash_area_open(uint8_t id, const struct flash_area **fa)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(areas); i++) {
+        if (areas[i].fa_id == id) {
+            *fa = &areas[i];
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+void flash_area_close(const struct flash_area *fa)
+{
+}
+
+const struct device *flash_area_get_device(const struct flash_area *fa)
+{
+    return fa->fa_dev;
+}
+
+uint32_t flash_area_align(const struct flash_area *fa)
+{
+    return flash_align;
+}
+
+int flash_area_read(const struct flash_area *fa, off_t off, void *dst, size_t len)
+{
+    if (off < 0 || off + len > fa->fa_size) {
+        return -EINVAL;
+    }
+    memcpy(dst, flash + fa->fa_off + off, len);
+    return 0;
+}
+
+int flash_area_write(const struct flash_area *fa, off_t off, const void *src, size_t len)
+{
+    if (off < 0 || off + len > fa->fa_size) {
+        printf("sim: write outside partition %u at 0x%lx+%zu\n", fa->fa_id, (long)off, len);
+        return -EINVAL;
+    }
+    if (off % flash_align || len % flash_align) {
+        printf("sim: unaligned write at 0x%lx+%zu\n", (long)off, len);
+        abort();
+    }
+
+    bool torn = flash_op();
+    uint8_t *dst = flash + fa->fa_off + off;
+    const uint8_t *data = src;
+    size_t n = torn ? len / 2 : len;
+    for (size_t i = 0; i < n; i++) {
+        if (flash_params.caps & FLASH_ERASE_C_EXPLICIT) {
+            // NOR programming only clears bits
+            if ((dst[i] & data[i]) != data[i]) {
+                printf("sim: NOR write over programmed bits at 0x%lx+%zu\n", (long)off, i);
+                abort();
+            }
+            dst[i] &= data[i];
+        } else {
+            dst[i] = data[i];
+        }
+    }
+    if (torn) {
+        power_cut_now();
+    }
+    return 0;
+}
+
+int flash_area_erase(const struct flash_area *fa, off_t off, size_t len)
+{
+    if (off < 0 || off + len > fa->fa_size || off % SIM_PAGE_SIZE || len % SIM_PAGE_SIZE) {
+        printf("sim: bad erase at 0x%lx+%zu\n", (long)off, len);
+        return -EINVAL;
+    }
+    if (flash_op()) {
+        // An interrupted erase leaves the page partly erased
+        memset(flash + fa->fa_off + off, 0xFF, len / 2);
+        power_cut_now();
+    }
+    memset(flash + fa->fa_off + off, 0xFF, len);
+    return 0;
+}
+
+// ---- Metadata: NVS stand-in ----
+//
+// A small id/value table at the start of the nvs_storage partition. Entries
+// are replaced whole, standing in for NVS's atomic writes, and are not
+// counted as flash operations.
+
+typedef struct {
+    uint16_t id;
+    uint16_t len;
+    uint8_t data[28];
+} nvs_entry_t;
+
+#define NVS_ENTRIES 16
+
+int nvs_mount(struct nvs_fs *fs)
+{
+    return 0;
+}
+
+ssize_t nvs_write(struct nvs_fs *fs, uint16_t id, const void *data, size_t len)
+{
+    nvs_entry_t *e = (nvs_entry_t *)(flash + areas[0].fa_off);
+
+    if (len > sizeof(e->data)) {
+        return -EINVAL;
+    }
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+        if (e[i].id == id || e[i].id == 0xFFFF) {
+            e[i].id = id;
+            e[i].len = len;
+            memcpy(e[i].data, data, len);
+            return len;
+        }
+    }
+    return -ENOSPC;
+}
+
+ssize_t nvs_read(struct nvs_fs *fs, uint16_t id, void *data, size_t len)
+{
+    nvs_entry_t *e = (nvs_entry_t *)(flash + areas[0].fa_off);
+
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+        if (e[i].id == id) {
+            memcpy(data, e[i].data, MIN(len, e[i].len));
+            return e[i].len;
+        }
+    }
+    return -ENOENT;
+}
+
+uint32_t crc32_ieee_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+uint32_t crc32_ieee(const uint8_t *data, size_t len)
+{
+    return crc32_ieee_update(0, data, len);
+}
+
+// ---- Kernel ----
+
+int64_t k_uptime_get(void)
+{
+    return uptime_ms;
+}
+
+uint32_t k_uptime_get_32(void)
+{
+    return (uint32_t)uptime_ms;
+}
+
+uint32_t k_cycle_get_32(void)
+{
+    return (uint32_t)(uptime_ms * 128000);
+}
+
+void k_sem_give(struct k_sem *sem)
+{
+    pthread_mutex_lock(&sem->m);
+    if (sem->count < sem->limit) {
+        sem->count++;
+    }
+    pthread_cond_signal(&sem->c);
+    pthread_mutex_unlock(&sem->m);
+}
+
+int k_sem_take(struct k_sem *sem, k_timeout_t timeout)
+{
+    pthread_mutex_lock(&sem->m);
+    while (sem->count == 0) {
+        if (timeout.ms == 0) {
+            pthread_mutex_unlock(&sem->m);
+            return -EBUSY;
+        }
+        pthread_cond_wait(&sem->c, &sem->m);
+    }
+    sem->count--;
+    pthread_mutex_unlock(&sem->m);
+    return 0;
+}
+
+void k_event_post(struct k_event *event, uint32_t events)
+{
+    pthread_mutex_lock(&event->m);
+    event->events |= events;
+    pthread_cond_broadcast(&event->c);
+    pthread_mutex_unlock(&event->m);
+}
+
+void k_event_clear(struct k_event *event, uint32_t events)
+{
+    pthread_mutex_lock(&event->m);
+    event->events &= ~events;
+    pthread_mutex_unlock(&event->m);
+}
+
+uint32_t k_event_wait(struct k_event *event, uint32_t events, bool reset, k_timeout_t timeout)
+{
+    pthread_mutex_lock(&event->m);
+    if (reset) {
+        event->events = 0;
+    }
+    while (!(event->events & events)) {
+        if (timeout.ms == 0) {
+            pthread_mutex_unlock(&event->m);
+            return 0;
+        }
+        pthread_cond_wait(&event->c, &event->m);
+    }
+    uint32_t matched = event->events & events;
+    pthread_mutex_unlock(&event->m);
+    return matched;
+}
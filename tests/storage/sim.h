@@ -0,0 +1,73 @@
+#ifndef SIM_H
+#define SIM_H
+
+// Host simulation of the flash partitions for the storage tests.
+//
+// Every simulated boot runs in a forked process, so module state starts from
+// scratch while flash persists in sim_flash.bin in the working directory. A
+// boot can lose power on any flash write or erase; with a warm reset the
+// __noinit RAM survives into the next boot like retained RAM does.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "storage.h"
+
+typedef struct {
+    bool rram;            // RRAM: 16-byte writes, no erase. NOR otherwise: 4-byte
+                          // writes that only clear bits, explicit page erase
+    bool torn;            // The write hit by a power cut programs half its bytes
+    uint32_t data_size;   // sensor_storage size in bytes, 0 = the pm.yml size
+} sim_flash_config_t;
+
+// Exit status of a boot that lost power
+#define SIM_POWER_CUT 42
+
+// Flash layout and type for the following boots
+void sim_configure(const sim_flash_config_t *config);
+
+// Flash options from the command line: --rram, --torn, --size=<bytes>
+void sim_configure_args(int argc, char **argv);
+
+// New device: erased flash, no retained RAM
+void sim_wipe(void);
+
+// Boot and run fn(arg) in a fresh process; returns its result or
+// SIM_POWER_CUT. cut_after >= 0 cuts power at that flash operation of the
+// boot (0 = the first write or erase); warm keeps the __noinit RAM for the
+// next boot, whether the boot lost power or fn returned (a reset).
+int sim_boot(int (*fn)(void *arg), void *arg, long cut_after, bool warm);
+
+// Simulated uptime of the current boot
+void sim_advance(int64_t ms);
+
+// Memory shared by the test and all its boots, zeroed
+void *sim_shared_alloc(size_t size);
+
+// Flash operations (writes and erases) of the current boot so far
+long sim_flash_ops(void);
+
+// Test record number seq: a slow temperature swing, below freezing part of
+// the time, with short hot spells (300 and up) near the end of every 20000
+// records; pressure and humidity in slow steps; a battery that loses 0.1 V
+// every 8000 records. Tests recompute it to check what they read back.
+sensor_record_t sim_record(uint32_t seq);
+
+// Write the next n sim_record()s SENSOR_READ_INTERVAL_SEC apart, flushing
+// after every flush_every of them (0 = never). A full staging ring is
+// flushed and the write retried; any other error fails the test. Records
+// after the last flush stay staged.
+void sim_write_records(uint32_t n, uint32_t flush_every);
+
+// Report a failed check and count it; boots return sim_failures() != 0
+#define SIM_CHECK(cond, fmt, ...)                                               \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            sim_fail("%s:%d: " fmt, __FILE__, __LINE__, ##__VA_ARGS__);         \
+        }                                                                       \
+    } while (0)
+
+void sim_fail(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int sim_failures(void);
+
+#endif // SIM_H
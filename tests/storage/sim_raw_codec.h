@@ -0,0 +1,5 @@
+// Forced into the storage_sim_mmap build: new pages use the raw codec, so
+// cursors read records straight from memory-mapped pages
+#include "config.h"
+#undef STORAGE_CODEC_DELTA
+#define STORAGE_CODEC_DELTA 0
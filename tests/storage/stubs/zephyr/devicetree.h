@@ -0,0 +1,10 @@
+#include <zephyr/sim_kernel.h>
+
+// Memory-mapped flash of the storage_sim_mmap build: the simulated flash
+uintptr_t sim_flash_base(void);
+#define DT_CHOSEN(prop) 0
+#define DT_REG_ADDR(node) sim_flash_base()
+
+// No retained_ram region: the staging ring goes to __noinit (sim_noinit)
+#define DT_NODELABEL(label) 0
+#define DT_NODE_EXISTS(node) 0
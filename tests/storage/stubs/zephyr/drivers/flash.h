@@ -0,0 +1,8 @@
+#pragma once
+#include <zephyr/sim_kernel.h>
+struct flash_pages_info { off_t start_offset; size_t size; uint32_t index; };
+struct flash_parameters { size_t write_block_size; uint8_t erase_value; uint32_t caps; };
+#define FLASH_ERASE_C_EXPLICIT 1
+static inline int flash_params_get_erase_cap(const struct flash_parameters *p) { return p->caps; }
+const struct flash_parameters *flash_get_parameters(const struct device *dev);
+int flash_get_page_info_by_offs(const struct device *dev, off_t offs, struct flash_pages_info *info);
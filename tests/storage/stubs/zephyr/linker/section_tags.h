@@ -0,0 +1,2 @@
+// Retained RAM: sim.c saves this section on a simulated warm reset
+#define __noinit __attribute__((section("sim_noinit")))
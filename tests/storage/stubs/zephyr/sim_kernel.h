@@ -0,0 +1,118 @@
+#ifndef SIM_KERNEL_H
+#define SIM_KERNEL_H
+
+// Host stand-ins for the Zephyr kernel API used by the storage modules.
+// Mutexes, semaphores and events map to pthreads; time is simulated
+// (sim_advance() in sim.h) so tests control the flush policy and markers.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// sys/util.h
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define CLAMP(v, lo, hi) MIN(MAX(v, lo), hi)
+#define ROUND_UP(x, a) ((((x) + (a) - 1) / (a)) * (a))
+#define ROUND_DOWN(x, a) (((x) / (a)) * (a))
+#define DIV_ROUND_UP(x, a) (((x) + (a) - 1) / (a))
+#define IS_POWER_OF_TWO(x) (((x) != 0U) && (((x) & ((x) - 1U)) == 0U))
+#define BIT(n) (1UL << (n))
+#define IS_ENABLED(x) 0
+#define __aligned(x) __attribute__((aligned(x)))
+#define __packed __attribute__((packed))
+#define ARG_UNUSED(x) (void)(x)
+#define BUILD_ASSERT(c, ...) _Static_assert(c, "" __VA_ARGS__)
+#define CONTAINER_OF(ptr, type, field) ((type *)(((char *)(ptr)) - offsetof(type, field)))
+
+// logging/log.h: printed when SIM_LOG is set in the environment
+extern int sim_log_enabled;
+#define LOG_MODULE_REGISTER(...)
+#define LOG_LEVEL_DBG 4
+#define LOG_LEVEL_INF 3
+#define SIM_LOG(level, fmt, ...) \
+    do { if (sim_log_enabled) printf(level ": " fmt "\n", ##__VA_ARGS__); } while (0)
+#define LOG_ERR(fmt, ...) SIM_LOG("E", fmt, ##__VA_ARGS__)
+#define LOG_WRN(fmt, ...) SIM_LOG("W", fmt, ##__VA_ARGS__)
+#define LOG_INF(fmt, ...) SIM_LOG("I", fmt, ##__VA_ARGS__)
+#define LOG_DBG(fmt, ...) SIM_LOG("D", fmt, ##__VA_ARGS__)
+
+// Time
+#define MSEC_PER_SEC 1000
+typedef struct { int64_t ms; } k_timeout_t;
+#define K_FOREVER ((k_timeout_t){ -1 })
+#define K_NO_WAIT ((k_timeout_t){ 0 })
+#define K_MSEC(ms) ((k_timeout_t){ (ms) })
+#define K_SECONDS(s) ((k_timeout_t){ (int64_t)(s) * MSEC_PER_SEC })
+int64_t k_uptime_get(void);
+uint32_t k_uptime_get_32(void);
+uint32_t k_cycle_get_32(void);
+
+// Spinlocks and mutexes
+struct k_spinlock { int unused; };
+typedef int k_spinlock_key_t;
+extern pthread_mutex_t sim_spin_mutex;
+static inline k_spinlock_key_t k_spin_lock(struct k_spinlock *l)
+{
+    (void)l;
+    pthread_mutex_lock(&sim_spin_mutex);
+    return 0;
+}
+static inline void k_spin_unlock(struct k_spinlock *l, k_spinlock_key_t key)
+{
+    (void)l;
+    (void)key;
+    pthread_mutex_unlock(&sim_spin_mutex);
+}
+
+struct k_mutex { pthread_mutex_t m; };
+#define K_MUTEX_DEFINE(name) struct k_mutex name = { PTHREAD_MUTEX_INITIALIZER }
+static inline int k_mutex_lock(struct k_mutex *m, k_timeout_t t)
+{
+    (void)t;
+    return pthread_mutex_lock(&m->m);
+}
+static inline int k_mutex_unlock(struct k_mutex *m)
+{
+    return pthread_mutex_unlock(&m->m);
+}
+
+// Semaphores and events; a non-zero timeout waits until signalled
+struct k_sem { pthread_mutex_t m; pthread_cond_t c; unsigned int count, limit; };
+#define K_SEM_DEFINE(name, initial, lim) \
+    struct k_sem name = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, initial, lim }
+void k_sem_give(struct k_sem *sem);
+int k_sem_take(struct k_sem *sem, k_timeout_t timeout);
+
+struct k_event { pthread_mutex_t m; pthread_cond_t c; uint32_t events; };
+#define K_EVENT_DEFINE(name) \
+    struct k_event name = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }
+void k_event_post(struct k_event *event, uint32_t events);
+void k_event_clear(struct k_event *event, uint32_t events);
+uint32_t k_event_wait(struct k_event *event, uint32_t events, bool reset, k_timeout_t timeout);
+
+// Threads are registered here and started by every simulated boot
+typedef void (*sim_thread_fn_t)(void *, void *, void *);
+void sim_thread_register(sim_thread_fn_t fn);
+#define K_THREAD_DEFINE(name, stack, fn, a, b, c, prio, options, delay) \
+    __attribute__((constructor)) static void name##_register(void) { sim_thread_register(fn); }
+
+// Atomics
+typedef long atomic_t;
+typedef atomic_t atomic_val_t;
+#define ATOMIC_INIT(v) (v)
+static inline long atomic_get(const atomic_t *a) { return __atomic_load_n(a, __ATOMIC_SEQ_CST); }
+static inline long atomic_set(atomic_t *a, long v) { return __atomic_exchange_n(a, v, __ATOMIC_SEQ_CST); }
+static inline long atomic_add(atomic_t *a, long v) { return __atomic_fetch_add(a, v, __ATOMIC_SEQ_CST); }
+static inline long atomic_inc(atomic_t *a) { return atomic_add(a, 1); }
+
+// Devices
+struct device { int unused; };
+
+#endif // SIM_KERNEL_H
@@ -0,0 +1,14 @@
+#pragma once
+#include <zephyr/sim_kernel.h>
+#include <zephyr/drivers/flash.h>
+struct flash_area { uint8_t fa_id; off_t fa_off; size_t fa_size; const struct device *fa_dev; };
+enum { SIM_PARTITION_nvs_storage = 1, SIM_PARTITION_sensor_storage, SIM_PARTITION_rollup_storage };
+#define FIXED_PARTITION_ID(label) SIM_PARTITION_##label
+#define FIXED_PARTITION_EXISTS(label) 1
+int flash_area_open(uint8_t id, const struct flash_area **fa);
+void flash_area_close(const struct flash_area *fa);
+int flash_area_read(const struct flash_area *fa, off_t off, void *dst, size_t len);
+int flash_area_write(const struct flash_area *fa, off_t off, const void *src, size_t len);
+int flash_area_erase(const struct flash_area *fa, off_t off, size_t len);
+uint32_t flash_area_align(const struct flash_area *fa);
+const struct device *flash_area_get_device(const struct flash_area *fa);
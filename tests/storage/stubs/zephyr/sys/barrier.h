@@ -0,0 +1,2 @@
+#include <zephyr/sim_kernel.h>
+#define barrier_dmem_fence_full() __atomic_thread_fence(__ATOMIC_SEQ_CST)
@@ -0,0 +1,4 @@
+#pragma once
+#include <zephyr/sim_kernel.h>
+uint32_t crc32_ieee(const uint8_t *data, size_t len);
+uint32_t crc32_ieee_update(uint32_t crc, const uint8_t *data, size_t len);
@@ -0,0 +1 @@
+#include <zephyr/sim_kernel.h>
@@ -0,0 +1,110 @@
+// rollup_aggregate() (CMD_AGGREGATE): statistics over record ranges match
+// the records, with whole hour and day blocks served from the rollups after
+// their raw records were overwritten.
+//
+//   test_aggregate [--rram] [--size=<bytes>] [records]
+
+#include "sim.h"
+#include "storage.h"
+#include "rollup.h"
+#include "config.h"
+#include <stdlib.h>
+
+#define HOUR_RECORDS (3600 / SENSOR_READ_INTERVAL_SEC)
+#define DAY_RECORDS (HOUR_RECORDS * 24)
+
+static uint32_t records = 30000;
+
+// Check one range: records still in the log count, older ones only as
+// part of a whole closed hour block inside the range
+static void check_range(uint32_t from, uint32_t to)
+{
+    uint32_t first = storage_get_first_seq();
+    uint32_t next = storage_get_next_seq();
+    int32_t min[4], max[4];
+    int64_t sum[4] = { 0 };
+    uint32_t count = 0;
+
+    for (uint32_t seq = from; seq < MIN(to, next); seq++) {
+        uint32_t block = seq - seq % HOUR_RECORDS;
+        bool in_rollup = block >= from && block + HOUR_RECORDS <= MIN(to, next);
+        if (seq < first && !in_rollup) {
+            continue;
+        }
+        sensor_record_t r = sim_record(seq);
+        int32_t f[4] = { r.temp_x10, r.press_kpa, r.hum_pct, r.battery_v_x10 };
+        for (int i = 0; i < 4; i++) {
+            min[i] = count ? MIN(min[i], f[i]) : f[i];
+            max[i] = count ? MAX(max[i], f[i]) : f[i];
+            sum[i] += f[i];
+        }
+        count++;
+    }
+
+    rollup_stats_t stats;
+    int err = rollup_aggregate(from, to, &stats);
+    if (count == 0) {
+        SIM_CHECK(err == -ENODATA, "%u..%u: %d, expected no data", from, to, err);
+        return;
+    }
+    SIM_CHECK(err == 0, "%u..%u: %d", from, to, err);
+    if (err) {
+        return;
+    }
+
+    int32_t smin[4] = { stats.min.temp_x10, stats.min.press_kpa, stats.min.hum_pct,
+                        stats.min.battery_v_x10 };
+    int32_t smax[4] = { stats.max.temp_x10, stats.max.press_kpa, stats.max.hum_pct,
+                        stats.max.battery_v_x10 };
+    int32_t smean[4] = { stats.mean.temp_x10, stats.mean.press_kpa, stats.mean.hum_pct,
+                         stats.mean.battery_v_x10 };
+    SIM_CHECK(stats.count == count, "%u..%u: count %u, expected %u", from, to, stats.count,
+              count);
+    for (int i = 0; i < 4; i++) {
+        // Means of stored blocks are rounded: allow one unit
+        double mean = (double)sum[i] / count;
+        SIM_CHECK(smin[i] == min[i] && smax[i] == max[i] &&
+                  smean[i] >= mean - 1.0 && smean[i] <= mean + 1.0,
+                  "%u..%u field %d: min %d/%d max %d/%d mean %d/%.2f", from, to, i,
+                  smin[i], min[i], smax[i], max[i], smean[i], mean);
+    }
+}
+
+static int boot_aggregate(void *arg)
+{
+    ARG_UNUSED(arg);
+    if (storage_init() != 0) {
+        return 1;
+    }
+    sim_write_records(records, 10);
+    SIM_CHECK(storage_flush(K_SECONDS(1)) == 0, "flush");
+
+    uint32_t next = storage_get_next_seq();
+    srand(1);
+    for (int k = 0; k < 300; k++) {
+        uint32_t from = rand() % next;
+        uint32_t to = from + 1 + rand() % (k < 150 ? 2000 : next);
+        if (k % 3 == 0) {
+            from -= from % HOUR_RECORDS;
+        }
+        if (k % 5 == 0) {
+            from -= from % DAY_RECORDS;
+            to = from + DAY_RECORDS * (1 + rand() % 3);
+        }
+        check_range(from, to);
+    }
+    check_range(0, next);
+    check_range(next, next + 10);
+    printf("next_seq %u, first_seq %u\n", next, storage_get_first_seq());
+    return sim_failures();
+}
+
+int main(int argc, char **argv)
+{
+    sim_configure_args(argc, argv);
+    if (argc > 1 && argv[argc - 1][0] != '-') {
+        records = strtoul(argv[argc - 1], NULL, 0);
+    }
+    sim_wipe();
+    return sim_boot(boot_aggregate, NULL, -1, false) != 0;
+}
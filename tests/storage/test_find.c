@@ -0,0 +1,93 @@
+// storage_find(): threshold and range searches return every matching record
+// in order, staged ones included, and the zone maps rule out pages that
+// cannot match.
+//
+//   test_find [--rram] [--size=<bytes>] [records]
+
+#include "sim.h"
+#include "storage.h"
+#include <stdlib.h>
+
+static uint32_t records = 25000;
+
+typedef struct {
+    storage_field_t field;
+    int32_t min;
+    int32_t max;
+    bool selective;          // Matches few pages: the zone maps must skip some
+} query_t;
+
+static const query_t queries[] = {
+    { STORAGE_FIELD_TEMP, 281, INT32_MAX, true },
+    { STORAGE_FIELD_TEMP, INT32_MIN, 180, false },
+    { STORAGE_FIELD_HUM, 69, 69, false },
+    { STORAGE_FIELD_BATTERY, 0, 34, true },
+    { STORAGE_FIELD_PRESS, 1002, 1002, false },
+};
+
+static void run_query(const query_t *q)
+{
+    uint32_t first = storage_get_first_seq();
+    uint32_t next = storage_get_next_seq();
+    storage_stats_t before, after;
+    sensor_record_t r;
+    uint32_t seq = first;
+    int err;
+
+    storage_get_stats(&before);
+    while ((err = storage_find(q->field, q->min, q->max, &seq, &r)) == 0) {
+        // Every record skipped since the last match must not match
+        for (uint32_t s = first; s < seq; s++) {
+            sensor_record_t skipped = sim_record(s);
+            int32_t v = storage_record_field(&skipped, q->field);
+            SIM_CHECK(v < q->min || v > q->max, "field %d: record %u missed", q->field, s);
+        }
+        sensor_record_t expect = sim_record(seq);
+        SIM_CHECK(seq < next && memcmp(&r, &expect, sizeof(r)) == 0,
+                  "field %d: wrong record %u", q->field, seq);
+        int32_t v = storage_record_field(&r, q->field);
+        SIM_CHECK(v >= q->min && v <= q->max, "field %d: record %u = %d out of range",
+                  q->field, seq, v);
+        first = ++seq;
+    }
+    SIM_CHECK(err == -ENOENT, "field %d: storage_find %d", q->field, err);
+    for (uint32_t s = first; s < next; s++) {
+        sensor_record_t skipped = sim_record(s);
+        int32_t v = storage_record_field(&skipped, q->field);
+        SIM_CHECK(v < q->min || v > q->max, "field %d: record %u missed", q->field, s);
+    }
+
+    storage_get_stats(&after);
+    uint32_t skipped = after.zone_pages_skipped - before.zone_pages_skipped;
+    SIM_CHECK(!q->selective || skipped > 0, "field %d [%d, %d]: no page skipped", q->field,
+              q->min, q->max);
+}
+
+static int boot_find(void *arg)
+{
+    ARG_UNUSED(arg);
+    if (storage_init() != 0) {
+        return 1;
+    }
+    // The last records stay staged in RAM
+    sim_write_records(records, 50);
+    for (size_t i = 0; i < ARRAY_SIZE(queries); i++) {
+        run_query(&queries[i]);
+    }
+    storage_flush(K_SECONDS(1));
+    for (size_t i = 0; i < ARRAY_SIZE(queries); i++) {
+        run_query(&queries[i]);
+    }
+    printf("next_seq %u, first_seq %u\n", storage_get_next_seq(), storage_get_first_seq());
+    return sim_failures();
+}
+
+int main(int argc, char **argv)
+{
+    sim_configure_args(argc, argv);
+    if (argc > 1 && argv[argc - 1][0] != '-') {
+        records = strtoul(argv[argc - 1], NULL, 0);
+    }
+    sim_wipe();
+    return sim_boot(boot_find, NULL, -1, false) != 0;
+}
@@ -0,0 +1,76 @@
+// Log round trip: records written across flushes, boots and ring wraps read
+// back the same through storage_read() and cursors.
+//
+//   test_log [--rram] [--size=<bytes>] [records]
+
+#include "sim.h"
+#include "storage.h"
+#include <stdlib.h>
+
+static uint32_t records = 3000;
+
+// Every record from first_seq on, once through storage_read() and once
+// through a cursor
+static void verify_log(void)
+{
+    uint32_t first = storage_get_first_seq();
+    uint32_t next = storage_get_next_seq();
+
+    for (uint32_t seq = first; seq < next; seq++) {
+        sensor_record_t r, expect = sim_record(seq);
+        int err = storage_read(seq, &r);
+        SIM_CHECK(err == 0, "read %u: %d", seq, err);
+        SIM_CHECK(err || memcmp(&r, &expect, sizeof(r)) == 0, "read %u: wrong record", seq);
+    }
+    SIM_CHECK(first == 0 || storage_read(first - 1, &(sensor_record_t){ 0 }) != 0,
+              "record %u below first_seq still readable", first - 1);
+
+    storage_cursor_t cursor;
+    storage_cursor_open(&cursor, first);
+    while (cursor.next_seq < next) {
+        const sensor_record_t *span;
+        uint32_t count;
+        int err = storage_cursor_next_batch(&cursor, &span, 50, &count);
+        if (err || count == 0) {
+            SIM_CHECK(false, "cursor at %u: %d", cursor.next_seq, err);
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t seq = cursor.next_seq - count + i;
+            sensor_record_t expect = sim_record(seq);
+            SIM_CHECK(memcmp(&span[i], &expect, sizeof(expect)) == 0,
+                      "cursor %u: wrong record", seq);
+        }
+    }
+}
+
+static int boot_write(void *arg)
+{
+    if (storage_init() != 0) {
+        return 1;
+    }
+    verify_log();
+    sim_write_records(records, 25);
+    SIM_CHECK(storage_flush(K_SECONDS(1)) == 0, "flush");
+    verify_log();
+    printf("next_seq %u, first_seq %u\n", storage_get_next_seq(), storage_get_first_seq());
+    return sim_failures();
+}
+
+int main(int argc, char **argv)
+{
+    sim_configure_args(argc, argv);
+    if (argc > 1 && argv[argc - 1][0] != '-') {
+        records = strtoul(argv[argc - 1], NULL, 0);
+    }
+    sim_wipe();
+
+    // Fresh partition, then reboots that recover the log and append to it
+    for (int boot = 0; boot < 3; boot++) {
+        if (sim_boot(boot_write, NULL, -1, false) != 0) {
+            printf("boot %d failed\n", boot);
+            return 1;
+        }
+    }
+    return 0;
+}
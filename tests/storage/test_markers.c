@@ -0,0 +1,190 @@
+// Time markers: every stored record resolves through a cursor to the boot,
+// uptime and wall-clock time it was sampled at, across reboots, a clock set
+// mid-boot, downsampling and refused samples.
+//
+//   test_markers [--rram] [--size=<bytes>]
+
+#include "sim.h"
+#include "storage.h"
+#include "config.h"
+#include <stdlib.h>
+
+#define MAX_RECORDS 100000
+#define EPOCH_BASE 1700000000u
+
+typedef struct {
+    uint32_t boot;           // Test boot that sampled the record
+    uint32_t uptime_s;
+    uint32_t epoch_s;        // Wall-clock time of the sample
+    bool dated;              // The clock was set before the sample: must be dated.
+                             // Earlier ones of the boot may be, correctly.
+} truth_t;
+
+static truth_t *truth;       // Shared by all boots, indexed by seq
+
+typedef struct {
+    uint32_t boot;
+    bool clock_set;
+    uint32_t samples;
+} sampler_t;
+
+// Wall clock of a test boot: epoch_s - uptime_s
+static uint32_t boot_epoch(uint32_t boot)
+{
+    return EPOCH_BASE + boot * 1000000;
+}
+
+// Take one sample SENSOR_READ_INTERVAL_SEC after the previous one; returns
+// storage_write()'s result
+static int sample(sampler_t *s)
+{
+    uint32_t seq = storage_get_next_seq();
+    uint32_t uptime_s = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+    sensor_record_t r = sim_record(seq);
+    int err = storage_write(&r);
+
+    // Downsampling returns 0 without storing the record
+    if (err == 0 && storage_get_next_seq() == seq + 1 && seq < MAX_RECORDS) {
+        truth[seq] = (truth_t){
+            .boot = s->boot,
+            .uptime_s = uptime_s,
+            .epoch_s = boot_epoch(s->boot) + uptime_s,
+            .dated = s->clock_set,
+        };
+    }
+    sim_advance(SENSOR_READ_INTERVAL_SEC * MSEC_PER_SEC);
+    if (++s->samples % 25 == 0) {
+        storage_flush(K_SECONDS(1));
+    }
+    return err;
+}
+
+static void set_clock(sampler_t *s)
+{
+    uint32_t uptime_s = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+    s->clock_set = true;
+    storage_set_epoch(boot_epoch(s->boot) + uptime_s);
+}
+
+// Every stored record against the truth; boot counts must grow with the
+// test boots
+static void verify_times(void)
+{
+    uint32_t first = storage_get_first_seq();
+    uint32_t next = storage_get_next_seq();
+    int64_t boot_count = -1;
+    uint32_t boot = UINT32_MAX;
+    uint32_t markers = 0;
+    uint32_t marker_seq = UINT32_MAX;
+
+    storage_cursor_t cursor;
+    storage_cursor_open(&cursor, first);
+    while (cursor.next_seq < next) {
+        const sensor_record_t *span;
+        uint32_t count;
+        uint32_t seq = cursor.next_seq;
+        int err = storage_cursor_next_batch(&cursor, &span, 1, &count);
+        if (err || count == 0) {
+            SIM_CHECK(false, "cursor at %u: %d", seq, err);
+            return;
+        }
+        if (cursor.marker.seq != marker_seq) {
+            markers++;
+            marker_seq = cursor.marker.seq;
+        }
+
+        storage_time_t time;
+        const truth_t *t = &truth[seq];
+        err = storage_cursor_time(&cursor, seq, &time);
+        SIM_CHECK(err == 0, "record %u: no time (%d)", seq, err);
+        if (err) {
+            continue;
+        }
+        if (t->boot != boot) {
+            SIM_CHECK((int64_t)time.boot_count > boot_count, "record %u: boot %u after %lld",
+                      seq, time.boot_count, (long long)boot_count);
+            boot = t->boot;
+            boot_count = time.boot_count;
+        }
+        SIM_CHECK(time.boot_count == boot_count, "record %u: boot %u, expected %lld", seq,
+                  time.boot_count, (long long)boot_count);
+        SIM_CHECK(time.uptime_s == t->uptime_s, "record %u: uptime %u, expected %u", seq,
+                  time.uptime_s, t->uptime_s);
+        SIM_CHECK(time.epoch_s == 0 ? !t->dated : time.epoch_s == t->epoch_s,
+                  "record %u: epoch %u, expected %u", seq, time.epoch_s, t->epoch_s);
+    }
+
+    // Markers stay sparse, downsampled stretches included
+    SIM_CHECK(next == first || markers * 20 < next - first, "%u markers for %u records",
+              markers, next - first);
+}
+
+// Clock set part way through the boot
+static int boot_clock(void *arg)
+{
+    sampler_t s = { .boot = *(uint32_t *)arg };
+    if (storage_init() != 0) {
+        return 1;
+    }
+    verify_times();
+    for (int i = 0; i < 300; i++) {
+        if (i == 100) {
+            set_clock(&s);
+        }
+        sample(&s);
+    }
+    storage_flush(K_SECONDS(1));
+    verify_times();
+    return sim_failures();
+}
+
+// Unacknowledged records fill the partition: downsampling, then refused
+// samples, then logging resumes once the gateway acknowledges them
+static int boot_backpressure(void *arg)
+{
+    sampler_t s = { .boot = *(uint32_t *)arg };
+    if (storage_init() != 0) {
+        return 1;
+    }
+    verify_times();
+    set_clock(&s);
+    storage_set_retention(STORAGE_RETENTION_DOWNSAMPLE);
+
+    bool downsampled = false;
+    uint32_t refused = 0;
+    for (uint32_t i = 0; i < 50000 && refused < 40; i++) {
+        downsampled |= (storage_get_backpressure() == STORAGE_BACKPRESSURE_DOWNSAMPLE);
+        if (sample(&s) == -ENOSPC) {
+            refused++;
+        }
+    }
+    SIM_CHECK(downsampled && refused == 40, "backpressure not reached");
+    storage_flush(K_SECONDS(1));
+    verify_times();
+
+    SIM_CHECK(storage_set_last_sent(storage_get_next_seq()) == 0, "acknowledge");
+    for (int i = 0; i < 300; i++) {
+        sample(&s);
+    }
+    storage_flush(K_SECONDS(1));
+    SIM_CHECK(storage_get_backpressure() == STORAGE_BACKPRESSURE_NONE, "backpressure left");
+    verify_times();
+    return sim_failures();
+}
+
+int main(int argc, char **argv)
+{
+    sim_configure_args(argc, argv);
+    truth = sim_shared_alloc(MAX_RECORDS * sizeof(*truth));
+    sim_wipe();
+
+    int (*boots[])(void *) = { boot_clock, boot_clock, boot_backpressure, boot_clock };
+    for (uint32_t boot = 0; boot < ARRAY_SIZE(boots); boot++) {
+        sim_advance(3000);
+        if (sim_boot(boots[boot], &boot, -1, false) != 0) {
+            printf("boot %u failed\n", boot);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,239 @@
+// Ack-driven retention: what each mode does once records the gateway has not
+// acknowledged fill the partition, and storage_set_last_sent() making room
+// again.
+//
+//   test_retention [--rram] [--size=<bytes>]
+
+#include "sim.h"
+#include "storage.h"
+#include "config.h"
+
+// Write until the log refuses a record with -ENOSPC, flushing every 25
+// records; returns the refused record's seq
+static uint32_t fill_log(void)
+{
+    for (uint32_t i = 0; i < 100000; i++) {
+        sensor_record_t r = sim_record(storage_get_next_seq());
+        int err = storage_write(&r);
+        if (err == -ENOSPC) {
+            break;
+        }
+        SIM_CHECK(err == 0, "write %u: %d", i, err);
+        sim_advance(SENSOR_READ_INTERVAL_SEC * MSEC_PER_SEC);
+        if (i % 25 == 24) {
+            SIM_CHECK(storage_flush(K_SECONDS(1)) == 0, "flush %u", i);
+        }
+    }
+    SIM_CHECK(storage_get_backpressure() == STORAGE_BACKPRESSURE_FULL, "log never refused");
+    return storage_get_next_seq();
+}
+
+// Write until the log reused its first page
+static void wrap_log(void)
+{
+    for (int i = 0; i < 1000 && storage_get_first_seq() == 0; i++) {
+        sim_write_records(100, 25);
+        SIM_CHECK(storage_flush(K_SECONDS(1)) == 0, "flush");
+    }
+    SIM_CHECK(storage_get_first_seq() > 0, "log did not wrap");
+}
+
+// Leaves records staged until the test flushes them
+static bool never_flush(const storage_flush_state_t *state)
+{
+    ARG_UNUSED(state);
+    return false;
+}
+
+// Every record from first_seq on reads back
+static void verify_log(void)
+{
+    uint32_t next = storage_get_next_seq();
+    for (uint32_t seq = storage_get_first_seq(); seq < next; seq++) {
+        sensor_record_t r, expect = sim_record(seq);
+        int err = storage_read(seq, &r);
+        SIM_CHECK(err == 0 && memcmp(&r, &expect, sizeof(r)) == 0, "read %u: %d", seq, err);
+    }
+}
+
+// Stop: once every page holds unacknowledged records, writes fail with
+// -ENOSPC and nothing is overwritten, until an acknowledgement frees pages
+static int boot_stop(void *arg)
+{
+    ARG_UNUSED(arg);
+    if (storage_init() != 0) {
+        return 1;
+    }
+    storage_set_retention(STORAGE_RETENTION_STOP);
+
+    uint32_t refused = fill_log();
+    storage_stats_t stats, after;
+    storage_get_stats(&stats);
+    SIM_CHECK(storage_get_first_seq() == 0 && stats.unacked_lost == 0,
+              "unacknowledged records overwritten: first_seq %u, lost %u",
+              storage_get_first_seq(), stats.unacked_lost);
+
+    sensor_record_t r = sim_record(refused);
+    SIM_CHECK(storage_write(&r) == -ENOSPC, "write into a full log accepted");
+    storage_get_stats(&after);
+    SIM_CHECK(after.records_skipped == stats.records_skipped + 1, "skipped %u, expected %u",
+              after.records_skipped, stats.records_skipped + 1);
+
+    // Acknowledging half the log lets logging go on
+    SIM_CHECK(storage_set_last_sent(refused / 2) == 0, "acknowledge");
+    SIM_CHECK(storage_get_backpressure() == STORAGE_BACKPRESSURE_NONE, "backpressure %d left",
+              storage_get_backpressure());
+    wrap_log();
+    SIM_CHECK(storage_get_first_seq() <= refused / 2,
+              "first_seq %u, acknowledged up to %u", storage_get_first_seq(), refused / 2);
+    SIM_CHECK(storage_get_backpressure() == STORAGE_BACKPRESSURE_NONE, "backpressure %d",
+              storage_get_backpressure());
+    storage_get_stats(&stats);
+    SIM_CHECK(stats.unacked_lost == 0, "%u unacknowledged records lost", stats.unacked_lost);
+    verify_log();
+    return sim_failures();
+}
+
+// Stop with records staged: the flush that would reuse an unacknowledged
+// page fails with -ENOSPC and keeps the records staged until the gateway
+// acknowledges
+static int boot_stop_flush(void *arg)
+{
+    ARG_UNUSED(arg);
+    if (storage_init() != 0) {
+        return 1;
+    }
+    storage_set_flush_policy(never_flush);
+    wrap_log();
+
+    // Stage records until they no longer fit in the head page
+    int err = 0;
+    for (int i = 0; i < 1000 && err == 0; i++) {
+        storage_set_retention(STORAGE_RETENTION_DROP_OLDEST);
+        sim_write_records(100, 0);
+        storage_set_retention(STORAGE_RETENTION_STOP);
+        err = storage_flush(K_SECONDS(1));
+    }
+    SIM_CHECK(err == -ENOSPC, "flush into a full log: %d", err);
+
+    uint32_t first = storage_get_first_seq();
+    uint32_t next = storage_get_next_seq();
+    storage_stats_t stats;
+    storage_get_stats(&stats);
+    sensor_record_t r = sim_record(next);
+    SIM_CHECK(storage_write(&r) == -ENOSPC, "write into a full log accepted");
+    SIM_CHECK(storage_flush(K_SECONDS(1)) == -ENOSPC, "staged records flushed into a full log");
+    SIM_CHECK(storage_get_first_seq() == first, "first_seq %u, was %u",
+              storage_get_first_seq(), first);
+
+    SIM_CHECK(storage_set_last_sent(next) == 0, "acknowledge");
+    SIM_CHECK(storage_flush(K_SECONDS(1)) == 0, "flush after the acknowledgement");
+    storage_stats_t after;
+    storage_get_stats(&after);
+    SIM_CHECK(after.unacked_lost == stats.unacked_lost, "%u unacknowledged records lost",
+              after.unacked_lost - stats.unacked_lost);
+    SIM_CHECK(storage_get_next_seq() == next, "next_seq %u, expected %u",
+              storage_get_next_seq(), next);
+    verify_log();
+    return sim_failures();
+}
+
+// Drop-oldest: the log wraps regardless and counts every unacknowledged
+// record it overwrites
+static int boot_drop_oldest(void *arg)
+{
+    ARG_UNUSED(arg);
+    if (storage_init() != 0) {
+        return 1;
+    }
+    storage_set_retention(STORAGE_RETENTION_DROP_OLDEST);
+
+    wrap_log();
+    storage_stats_t stats;
+    uint32_t first = storage_get_first_seq();
+    storage_get_stats(&stats);
+    SIM_CHECK(stats.unacked_lost == first, "lost %u, first_seq %u", stats.unacked_lost, first);
+
+    // Acknowledged records are dropped without counting
+    uint32_t acked = storage_get_next_seq();
+    SIM_CHECK(storage_set_last_sent(acked) == 0, "acknowledge");
+    for (int i = 0; i < 1000 && storage_get_first_seq() < acked; i++) {
+        sim_write_records(100, 25);
+        SIM_CHECK(storage_flush(K_SECONDS(1)) == 0, "flush");
+    }
+    storage_stats_t after;
+    storage_get_stats(&after);
+    SIM_CHECK(storage_get_first_seq() >= acked, "log did not wrap");
+    SIM_CHECK(after.unacked_lost == stats.unacked_lost + storage_get_first_seq() - acked,
+              "lost %u, %u before, first_seq %u, acknowledged %u", after.unacked_lost,
+              stats.unacked_lost, storage_get_first_seq(), acked);
+    verify_log();
+    return sim_failures();
+}
+
+// Downsample: past STORAGE_DOWNSAMPLE_FILL_PCT only one record in
+// STORAGE_DOWNSAMPLE_KEEP is stored, then the full log refuses them
+static int boot_downsample(void *arg)
+{
+    ARG_UNUSED(arg);
+    if (storage_init() != 0) {
+        return 1;
+    }
+    storage_set_retention(STORAGE_RETENTION_DOWNSAMPLE);
+
+    uint32_t samples = 0, stored = 0, thinned = 0;
+    storage_stats_t before, after;
+    storage_get_stats(&before);
+    while (samples < 100000 && storage_get_backpressure() != STORAGE_BACKPRESSURE_FULL) {
+        bool downsampling = storage_get_backpressure() == STORAGE_BACKPRESSURE_DOWNSAMPLE;
+        uint32_t next = storage_get_next_seq();
+        sensor_record_t r = sim_record(next);
+        int err = storage_write(&r);
+        if (err == -ENOBUFS || err == -ENOSPC) {
+            storage_flush(K_SECONDS(1));
+            continue;
+        }
+        SIM_CHECK(err == 0, "write %u: %d", samples, err);
+        samples++;
+        if (storage_get_next_seq() != next) {
+            stored++;
+        } else {
+            SIM_CHECK(downsampling, "sample %u skipped without backpressure", samples);
+            thinned++;
+        }
+        sim_advance(SENSOR_READ_INTERVAL_SEC * MSEC_PER_SEC);
+        if (samples % 25 == 0) {
+            storage_flush(K_SECONDS(1));
+        }
+    }
+    storage_get_stats(&after);
+    SIM_CHECK(storage_get_backpressure() == STORAGE_BACKPRESSURE_FULL, "log never filled");
+    SIM_CHECK(thinned > 0 && after.records_skipped - before.records_skipped >= thinned,
+              "%u samples thinned out, %u skipped", thinned,
+              after.records_skipped - before.records_skipped);
+    SIM_CHECK(after.unacked_lost == 0, "%u unacknowledged records lost", after.unacked_lost);
+    SIM_CHECK(storage_get_first_seq() == 0, "first_seq %u", storage_get_first_seq());
+
+    sensor_record_t r = sim_record(storage_get_next_seq());
+    SIM_CHECK(storage_write(&r) == -ENOSPC, "write into a full log accepted");
+    SIM_CHECK(storage_set_last_sent(storage_get_next_seq()) == 0, "acknowledge");
+    SIM_CHECK(storage_get_backpressure() == STORAGE_BACKPRESSURE_NONE, "backpressure %d left",
+              storage_get_backpressure());
+    return sim_failures();
+}
+
+int main(int argc, char **argv)
+{
+    sim_configure_args(argc, argv);
+
+    int (*boots[])(void *) = { boot_stop, boot_stop_flush, boot_drop_oldest,
+                                 boot_downsample };
+    for (size_t i = 0; i < ARRAY_SIZE(boots); i++) {
+        sim_wipe();
+        if (sim_boot(boots[i], NULL, -1, false) != 0) {
+            printf("retention boot %zu failed\n", i);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Seek cache: cursors opened inside a page (storage_read(), storage_find())
+// continue from a remembered decoder position, read the same records and
+// times as a cursor walked from the start of the log, and never use a
+// position on a page the writer has reused.
+//
+//   test_seek [--rram] [--size=<bytes>]
+
+#include "sim.h"
+#include "storage.h"
+#include "config.h"
+
+#define MAX_RECORDS 60000
+
+static storage_time_t times[MAX_RECORDS];
+
+// Times of every stored record through one cursor from first_seq
+static void walk_times(void)
+{
+    uint32_t next = storage_get_next_seq();
+    storage_cursor_t cursor;
+
+    storage_cursor_open(&cursor, storage_get_first_seq());
+    while (cursor.next_seq < next) {
+        const sensor_record_t *span;
+        uint32_t count;
+        int err = storage_cursor_next_batch(&cursor, &span, 50, &count);
+        if (err || count == 0) {
+            SIM_CHECK(false, "cursor at %u: %d", cursor.next_seq, err);
+            return;
+        }
+        for (uint32_t seq = cursor.next_seq - count; seq < cursor.next_seq; seq++) {
+            SIM_CHECK(storage_cursor_time(&cursor, seq, &times[seq % MAX_RECORDS]) == 0,
+                      "record %u: no time", seq);
+        }
+    }
+}
+
+// One record through a fresh cursor, checked against the walk
+static void read_one(uint32_t seq)
+{
+    storage_cursor_t cursor;
+    const sensor_record_t *span;
+    uint32_t count;
+    storage_time_t time;
+
+    storage_cursor_open(&cursor, seq);
+    int err = storage_cursor_next_batch(&cursor, &span, 1, &count);
+    sensor_record_t expect = sim_record(seq);
+    SIM_CHECK(err == 0 && count == 1 && memcmp(span, &expect, sizeof(expect)) == 0,
+              "record %u: %d, wrong record", seq, err);
+    if (err || count == 0) {
+        return;
+    }
+    const storage_time_t *t = &times[seq % MAX_RECORDS];
+    SIM_CHECK(storage_cursor_time(&cursor, seq, &time) == 0 &&
+              time.boot_count == t->boot_count && time.uptime_s == t->uptime_s,
+              "record %u: time %u/%u, expected %u/%u", seq, time.boot_count, time.uptime_s,
+              t->boot_count, t->uptime_s);
+}
+
+static void get_seek_stats(uint32_t *hits, uint32_t *misses)
+{
+    storage_stats_t stats;
+    storage_get_stats(&stats);
+    *hits = stats.seek_cache_hits;
+    *misses = stats.seek_cache_misses;
+}
+
+static int boot_seek(void *arg)
+{
+    ARG_UNUSED(arg);
+    if (storage_init() != 0) {
+        return 1;
+    }
+    sim_write_records(8000, 25);
+    SIM_CHECK(storage_flush(K_SECONDS(1)) == 0, "flush");
+    walk_times();
+
+    uint32_t first = storage_get_first_seq();
+    uint32_t next = storage_get_next_seq();
+    uint32_t hits, misses, hits0, misses0;
+
+    // Sequential: one miss per page at most
+    get_seek_stats(&hits0, &misses0);
+    for (uint32_t seq = first; seq < next; seq++) {
+        read_one(seq);
+    }
+    get_seek_stats(&hits, &misses);
+    printf("sequential: %u hits, %u misses for %u records\n", hits - hits0, misses - misses0,
+           next - first);
+    SIM_CHECK((misses - misses0) * 100 < next - first, "%u misses for %u records",
+              misses - misses0, next - first);
+
+    // Two readers far apart, stepping through their own pages
+    get_seek_stats(&hits0, &misses0);
+    uint32_t mid = first + (next - first) / 2;
+    for (uint32_t i = 0; i < 500; i++) {
+        read_one(first + i);
+        read_one(mid + i);
+    }
+    get_seek_stats(&hits, &misses);
+    SIM_CHECK((misses - misses0) * 20 < 1000, "interleaved: %u misses", misses - misses0);
+
+    // Backwards: every read starts before the remembered position
+    for (uint32_t seq = next; seq-- > next - 300;) {
+        read_one(seq);
+    }
+
+    // storage_find() reopens a cursor after every match
+    get_seek_stats(&hits0, &misses0);
+    uint32_t seq = first;
+    sensor_record_t r;
+    uint32_t matches = 0;
+    while (storage_find(STORAGE_FIELD_HUM, 40, 50, &seq, &r) == 0) {
+        sensor_record_t expect = sim_record(seq);
+        SIM_CHECK(memcmp(&r, &expect, sizeof(r)) == 0, "find: wrong record %u", seq);
+        matches++;
+        seq++;
+    }
+    get_seek_stats(&hits, &misses);
+    SIM_CHECK(matches > 100 && (misses - misses0) * 20 < matches, "find: %u misses, %u matches",
+              misses - misses0, matches);
+
+    // The writer reuses the pages: remembered positions on them must go
+    for (int round = 0; round < 3; round++) {
+        uint32_t from = storage_get_first_seq();
+        for (uint32_t s = from; s < from + 200; s++) {
+            read_one(s);
+        }
+        sim_write_records(4000, 25);
+        SIM_CHECK(storage_flush(K_SECONDS(1)) == 0, "flush");
+        SIM_CHECK(storage_get_first_seq() > from, "log did not wrap");
+        walk_times();
+        for (uint32_t s = storage_get_first_seq(); s < storage_get_next_seq(); s += 7) {
+            read_one(s);
+        }
+    }
+    return sim_failures();
+}
+
+int main(int argc, char **argv)
+{
+    sim_configure_args(argc, argv);
+    sim_wipe();
+    return sim_boot(boot_seek, NULL, -1, false) != 0;
+}